@@ -0,0 +1,89 @@
+/*
+ * Стабильный C API проверщика доменов для встраивания (C, Go через cgo и т.д.).
+ *
+ * Реализация находится в main.cpp; библиотека собирается из того же файла
+ * с макросом DOMAIN_CHECKER_LIBRARY, который убирает main():
+ *
+ *     g++ -std=c++17 -O2 -shared -fPIC -pthread -DDOMAIN_CHECKER_LIBRARY main.cpp -o libdomain_checker.so
+ *
+ * Проверщик открывается из скомпилированного индекса (режим --compile) и отображается в память.
+ * Домены передаются массивами указателей и длин без завершающего нуля и без копирования,
+ * поэтому накладные расходы на вызов через FFI делятся на весь пакет.
+ * Все функции потокобезопасны; checker_reload можно вызывать параллельно с проверками.
+ *
+ * Совместимость: функции и поля структур только добавляются, существующие не меняются.
+ */
+#ifndef DOMAIN_CHECKER_H
+#define DOMAIN_CHECKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHECKER_API_VERSION 4
+
+/* Флаги checker_open_compiled_ex; действуют и на последующие checker_reload. */
+#define CHECKER_OPEN_PREFAULT 1u  /* подгрузить все страницы индекса до возврата */
+#define CHECKER_OPEN_MLOCK 2u     /* закрепить страницы индекса в памяти (mlock) */
+#define CHECKER_OPEN_LAZY_VERIFY 4u  /* сверять контрольные суммы блоков при первом обращении, а не при открытии */
+
+/* Значения verdicts[i] в checker_check_batch. */
+#define CHECKER_VERDICT_GOOD 0     /* домен разрешён */
+#define CHECKER_VERDICT_BAD 1      /* домен или его супердомен запрещён */
+#define CHECKER_VERDICT_INVALID 2  /* строка не является именем хоста или IP-адресом (с версии 4) */
+
+typedef struct checker checker_t;
+
+typedef struct {
+    uint64_t rules;    /* число правил в текущем индексе */
+    uint64_t queries;  /* всего проверено доменов */
+    uint64_t matches;  /* из них запрещённых */
+    uint64_t reloads;  /* успешных перезагрузок */
+} checker_stats_t;
+
+typedef struct {
+    uint64_t time_to_ready_ns;        /* от начала (пере)загрузки до готовности индекса */
+    uint64_t time_to_first_query_ns;  /* от начала (пере)загрузки до конца первого пакета; 0 — ещё не было */
+    int locked;                       /* 1, если mlock удался */
+} checker_load_timing_t;
+
+/* Версия API, с которой собрана библиотека (CHECKER_API_VERSION). */
+int checker_api_version(void);
+
+/* Открывает скомпилированный индекс. При ошибке возвращает NULL, см. checker_last_error. */
+checker_t* checker_open_compiled(const char* path);
+
+/* То же с флагами CHECKER_OPEN_*. С CHECKER_OPEN_PREFAULT страницы подгружаются
+ * вспомогательными потоками до возврата, и первые запросы не ждут page fault. */
+checker_t* checker_open_compiled_ex(const char* path, unsigned flags);
+
+void checker_close(checker_t* checker);
+
+/* Проверяет count доменов и записывает в verdicts[i] значение CHECKER_VERDICT_*.
+ * Строки разбираются как в остальных режимах: одна завершающая точка отбрасывается.
+ * IP-адрес запрещён, только если в индексе есть ровно такой же литерал.
+ * Возвращает число запрещённых или -1 при неверных аргументах или (с CHECKER_OPEN_LAZY_VERIFY)
+ * при обнаружении повреждённого блока индекса, см. checker_last_error. */
+int64_t checker_check_batch(checker_t* checker, const char* const* domains, const size_t* lengths,
+                            size_t count, uint8_t* verdicts);
+
+/* Атомарно заменяет индекс новым из path. Идущие проверки дорабатывают со старым.
+ * Возвращает 0 или -1 (старый индекс остаётся), см. checker_last_error. */
+int checker_reload(checker_t* checker, const char* path);
+
+void checker_get_stats(const checker_t* checker, checker_stats_t* stats);
+
+/* Время готовности и время до первого запроса для последней (пере)загрузки. */
+void checker_get_load_timing(const checker_t* checker, checker_load_timing_t* timing);
+
+/* Текст последней ошибки в текущем потоке или пустая строка. */
+const char* checker_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DOMAIN_CHECKER_H */
@@ -1,21 +1,246 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
 #include <string>
 #include <sstream>
 #include <string_view>
 #include <vector>
 #include <set>
+#include <memory>
+#include <thread>
+#include <unordered_map>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "domain_checker.h"
 
 using namespace std;
 
+// Статические точки трассировки (USDT) провайдера domain_checker для bpftrace и perf, например:
+//   bpftrace -e 'usdt:./domain_checker:domain_checker:match { @rules[arg0] = count(); }'
+// Пока к точке ничего не подключено, на её месте стоит одна инструкция nop.
+// Без <sys/sdt.h> (пакет systemtap-sdt-dev) точки превращаются в пустые выражения.
+// Точки и аргументы:
+//   query__begin(длина домена), query__end(длина, число поисков суффиксов, номер правила или -1),
+//   match(номер правила, число поисков), batch__begin(размер или 0, если заранее неизвестен),
+//   batch__end(размер, запрещённых), reload__begin(), reload__end(число правил или -1 при ошибке).
+// Номер правила у DomainChecker — позиция в исходном списке, у CompiledDomainIndex — позиция ключа.
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_POINT0(name) DTRACE_PROBE(domain_checker, name)
+#define TRACE_POINT1(name, a) DTRACE_PROBE1(domain_checker, name, a)
+#define TRACE_POINT2(name, a, b) DTRACE_PROBE2(domain_checker, name, a, b)
+#define TRACE_POINT3(name, a, b, c) DTRACE_PROBE3(domain_checker, name, a, b, c)
+#else
+#define TRACE_POINT0(name) ((void)0)
+#define TRACE_POINT1(name, a) ((void)(a))
+#define TRACE_POINT2(name, a, b) ((void)(a), (void)(b))
+#define TRACE_POINT3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+// IP-адрес или CIDR-префикс ("10.0.0.0/8", "2001:db8::/32") в сетевом порядке байт.
+// Биты за пределами длины префикса обнулены.
+struct IpPrefix {
+    bool v6 = false;
+    array<uint8_t, 16> bytes{};
+    uint8_t length = 0;
+
+    size_t ByteCount() const {
+        return v6 ? 16 : 4;
+    }
+
+    // Распознаёт IP-литерал с необязательной длиной префикса; для имён хостов возвращает nullopt.
+    static optional<IpPrefix> Parse(const string& text) {
+        // Быстрый отсев имён хостов: в IPv4 только цифры и точки, в IPv6 обязательно есть ':'.
+        if (text.find(':') == string::npos && text.find_first_not_of("0123456789./") != string::npos) {
+            return nullopt;
+        }
+        const size_t slash = text.find('/');
+        // Адрес копируется в буфер на стеке, чтобы разбор не выделял память.
+        char address[INET6_ADDRSTRLEN];
+        const size_t address_size = min(slash, text.size());
+        if (address_size >= sizeof(address)) {
+            return nullopt;
+        }
+        text.copy(address, address_size);
+        address[address_size] = '\0';
+        IpPrefix prefix;
+        prefix.v6 = text.find(':') < address_size;
+        if (inet_pton(prefix.v6 ? AF_INET6 : AF_INET, address, prefix.bytes.data()) != 1) {
+            return nullopt;
+        }
+        const size_t max_length = prefix.ByteCount() * 8;
+        size_t length = max_length;
+        if (slash != string::npos) {
+            const string_view digits = string_view(text).substr(slash + 1);
+            if (digits.empty() || digits.size() > 3 || digits.find_first_not_of("0123456789") != string::npos) {
+                return nullopt;
+            }
+            length = 0;
+            for (const char digit : digits) {
+                length = length * 10 + static_cast<size_t>(digit - '0');
+            }
+            if (length > max_length) {
+                return nullopt;
+            }
+        }
+        prefix.length = static_cast<uint8_t>(length);
+        for (size_t bit = length; bit < max_length; ++bit) {
+            prefix.bytes[bit / 8] &= static_cast<uint8_t>(~(0x80u >> (bit % 8)));
+        }
+        return prefix;
+    }
+};
+
+// Почему строка не годится как имя хоста (RFC 1035/1123).
+enum class HostnameError {
+    NONE,
+    EMPTY_LABEL,     // пустая строка или пустая метка, например "a..b"
+    TOO_LONG,        // больше 253 символов без завершающей точки
+    LABEL_TOO_LONG,  // метка длиннее 63 символов
+    BAD_CHARACTER,   // допустимы только буквы, цифры, '-' и '_'
+};
+
+inline string_view HostnameErrorName(HostnameError error) {
+    switch (error) {
+    case HostnameError::NONE:
+        return {};
+    case HostnameError::EMPTY_LABEL:
+        return "empty_label"sv;
+    case HostnameError::TOO_LONG:
+        return "too_long"sv;
+    case HostnameError::LABEL_TOO_LONG:
+        return "label_too_long"sv;
+    case HostnameError::BAD_CHARACTER:
+        return "bad_character"sv;
+    }
+    return {};
+}
+
+// Записывает в out обращённую запись host и заодно проверяет его за тот же проход:
+// длины, классы символов (по таблице) и пустые метки. Одна завершающая точка
+// (корень в FQDN) отбрасывается. Запись строится и для некорректного имени,
+// а возвращается первая найденная ошибка.
+inline HostnameError ParseHostname(string_view host, string& out) {
+    static constexpr size_t MAX_LENGTH = 253;
+    static constexpr size_t MAX_LABEL_LENGTH = 63;
+    static constexpr array<bool, 256> allowed = [] {
+        array<bool, 256> result{};
+        for (int c = 0; c < 256; ++c) {
+            result[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                || c == '-' || c == '_';
+        }
+        return result;
+    }();
+
+    out.clear();
+    if (!host.empty() && host.back() == '.') {
+        host.remove_suffix(1);
+    }
+    if (host.empty()) {
+        return HostnameError::EMPTY_LABEL;
+    }
+    HostnameError error = host.size() > MAX_LENGTH ? HostnameError::TOO_LONG : HostnameError::NONE;
+    out.reserve(host.size());
+    size_t end = host.size();
+    for (size_t i = host.size(); ; --i) {
+        if (i == 0 || host[i - 1] == '.') {
+            const size_t length = end - i;
+            if (error == HostnameError::NONE && length == 0) {
+                error = HostnameError::EMPTY_LABEL;
+            } else if (error == HostnameError::NONE && length > MAX_LABEL_LENGTH) {
+                error = HostnameError::LABEL_TOO_LONG;
+            }
+            out.append(host.substr(i, length));
+            if (i == 0) { break; }
+            out += '.';
+            end = i - 1;
+        } else if (error == HostnameError::NONE && !allowed[static_cast<unsigned char>(host[i - 1])]) {
+            error = HostnameError::BAD_CHARACTER;
+        }
+    }
+    return error;
+}
+
+// Записывает в out обращённую запись домена host ("math.gdz.ru" → "ru.gdz.math").
+// Буфер out переиспользуется, поэтому после прогрева память не выделяется.
+inline void ReverseInto(string_view host, string& out) {
+    out.clear();
+    size_t end = host.size();
+    while (true) {
+        const size_t dot = end == 0 ? string_view::npos : host.rfind('.', end - 1);
+        const size_t begin = dot == string_view::npos ? 0 : dot + 1;
+        out.append(host.substr(begin, end - begin));
+        if (dot == string_view::npos) { break; }
+        out += '.';
+        end = dot;
+    }
+}
+
 // Класс Domain представляет доменное имя.
 // Внутри хранит обратный порядок частей (например, "a.b.com" → "com.b.a"),
 // чтобы легко проверять, является ли один домен суффиксом другого (через префикс в обратной форме).
+// IP-литералы не обращаются: для них хранится исходная запись и разобранный адрес.
 class Domain {
 public:
-    explicit Domain(const string& domains_list)
-        : reversed_domain_(ReverseDomain(domains_list)) {}
+    explicit Domain(const string& domains_list) {
+        Assign(domains_list);
+    }
+
+    // Разбирает новую запись на месте. Буфер обращённой записи переиспользуется,
+    // поэтому повторный разбор в цикле (см. frame_protocol) не выделяет память.
+    void Assign(const string& domains_list) {
+        ip_ = IpPrefix::Parse(domains_list);
+        error_ = HostnameError::NONE;
+        if (ip_) {
+            reversed_domain_ = domains_list;
+        } else {
+            error_ = ParseHostname(domains_list, reversed_domain_);
+        }
+    }
 
     bool operator==(const Domain& other) const {
         return reversed_domain_ == other.reversed_domain_;
@@ -29,31 +254,241 @@ public:
         return reversed_domain_;
     }
 
-private:
-    // Разбивает домен на части по точкам, затем собирает их в обратном порядке.
-    // Например: "math.gdz.ru" → части: ["math", "gdz", "ru"] → результат: "ru.gdz.math".
-    // Используется для сравнения суффиксов через лексикографический порядок.
-    static string ReverseDomain(const string& domain) {
-        vector<string> parts;
-        stringstream ss(domain);
-        string part;
+    // Адрес, если строка — IP-литерал, иначе nullopt.
+    const optional<IpPrefix>& GetIp() const {
+        return ip_;
+    }
 
-        // getline(ss, part, '.')
-        // Читает символы из ss пока не встретит '.' или конец строки.
-        // Считанная часть (без точки!) записывается в part.
-        while (getline(ss, part, '.')) {
-            parts.push_back(part);
-        }
+    // Почему запись не годится как имя хоста; NONE для корректных имён и IP-литералов.
+    HostnameError GetError() const {
+        return error_;
+    }
 
-        string result;
-        for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
-            if (it != parts.rbegin()) result += '.';
-            result += *it;
+    bool IsValid() const {
+        return error_ == HostnameError::NONE;
+    }
+
+    // Исходная запись домена, например "math.gdz.ru". Обращение точное, без разбора:
+    // ключ некорректного имени (".ru" хранится как "ru.") возвращается как был,
+    // поэтому дельты и журнал передают такие ключи без искажений.
+    string ToString() const {
+        if (ip_) {
+            return reversed_domain_;
         }
+        string result;
+        ReverseInto(reversed_domain_, result);
         return result;
     }
 
+    // Создаёт домен из уже обращённой записи (например, ключа из скомпилированного индекса).
+    static Domain FromReversed(string reversed) {
+        Domain domain;
+        domain.reversed_domain_ = move(reversed);
+        return domain;
+    }
+
+private:
+    Domain() = default;
+
+    optional<IpPrefix> ip_;
     string reversed_domain_;
+    HostnameError error_ = HostnameError::NONE;
+};
+
+// Перебирает суффиксы домена в обратной записи от самого короткого к полному.
+// Например: для "ru.gdz.math" вызывает f("ru"), f("ru.gdz"), f("ru.gdz.math").
+// Суффиксы — это string_view на исходную строку, поэтому копий не создаётся.
+// Если f вернёт true, перебор прекращается и функция возвращает true.
+template <typename Func>
+bool ForEachReversedSuffix(string_view rev, Func f) {
+    for (size_t pos = rev.find('.'); ; pos = rev.find('.', pos + 1)) {
+        if (f(rev.substr(0, pos))) { return true; }
+        if (pos == string_view::npos) { return false; }
+    }
+}
+
+// Сравнивает обращённые домены по меткам: точка меньше любого другого символа.
+// В таком порядке за доменом сразу идут все его поддомены:
+// "ru.gdz", "ru.gdz.math", "ru.gdz-x" — поддерево образует непрерывный диапазон.
+inline bool ReversedLess(string_view lhs, string_view rhs) {
+    return lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](char a, char b) {
+        const int ka = a == '.' ? -1 : static_cast<unsigned char>(a);
+        const int kb = b == '.' ? -1 : static_cast<unsigned char>(b);
+        return ka < kb;
+    });
+}
+
+// Лежит ли обращённый домен key в поддереве root (совпадает с ним или является поддоменом).
+inline bool IsInSubtree(string_view key, string_view root) {
+    return key.size() >= root.size() && key.substr(0, root.size()) == root
+        && (key.size() == root.size() || key[root.size()] == '.');
+}
+
+// Оценка занятой структурой памяти по составным частям, в байтах.
+// Учитываются данные и служебные поля контейнеров (узлы дерева, блоки shared_ptr),
+// но не заголовки блоков malloc, поэтому RSS процесса немного больше суммы.
+struct MemoryBreakdown {
+    vector<pair<string_view, size_t>> parts;
+
+    void Add(string_view part, size_t bytes) {
+        for (auto& [name, total] : parts) {
+            if (name == part) {
+                total += bytes;
+                return;
+            }
+        }
+        parts.emplace_back(part, bytes);
+    }
+
+    size_t Total() const {
+        size_t total = 0;
+        for (const auto& [name, bytes] : parts) {
+            total += bytes;
+        }
+        return total;
+    }
+};
+
+// Память строки вне самого объекта: 0, пока строка помещается в SSO-буфер.
+inline size_t HeapBytes(const string& text) {
+    static const size_t inline_capacity = string().capacity();
+    return text.capacity() > inline_capacity ? text.capacity() + 1 : 0;
+}
+
+// Многобитный бор IP-префиксов с шагом 8 бит (по байту адреса на уровень).
+// Префикс, не кратный байту, раскрывается в диапазон ячеек последнего уровня,
+// поэтому поиск — это не более 4 (IPv4) или 16 (IPv6) обращений к массивам без ветвлений по битам.
+// Для каждой ячейки хранится номер правила; при пересечении остаётся первое вставленное.
+class IpPrefixMatcher {
+public:
+    void Insert(const IpPrefix& prefix, uint32_t rule_id) {
+        Family& family = prefix.v6 ? v6_ : v4_;
+        if (prefix.length == 0) {
+            if (family.match_all == NO_RULE) {
+                family.match_all = rule_id;
+            }
+            return;
+        }
+        if (family.nodes.empty()) {
+            family.nodes.emplace_back();
+        }
+        const size_t last = (prefix.length - 1) / 8;
+        uint32_t node = 0;
+        for (size_t i = 0; i < last; ++i) {
+            uint32_t next = family.nodes[node].ChildAt(prefix.bytes[i]);
+            if (next == 0) {
+                next = static_cast<uint32_t>(family.nodes.size());
+                family.nodes[node].AddChild(prefix.bytes[i], next);
+                family.nodes.emplace_back();
+            }
+            node = next;
+        }
+        const size_t free_bits = (last + 1) * 8 - prefix.length;
+        const uint8_t first = prefix.bytes[last];
+        family.nodes[node].AddRule(first, static_cast<uint8_t>(first + (1u << free_bits) - 1), rule_id);
+    }
+
+    bool Matches(const IpPrefix& address) const {
+        return Find(address).has_value();
+    }
+
+    size_t MemoryUsage() const {
+        size_t bytes = (v4_.nodes.capacity() + v6_.nodes.capacity()) * sizeof(Node);
+        for (const Family* family : { &v4_, &v6_ }) {
+            for (const Node& node : family->nodes) {
+                bytes += node.children.capacity() * sizeof(Child) + node.rules.capacity() * sizeof(RuleRange);
+            }
+        }
+        return bytes;
+    }
+
+    // Номер правила, покрывающего адрес. Побеждает правило, кончающееся в самом раннем байте;
+    // среди правил, кончающихся в одном байте, — вставленное первым.
+    optional<uint32_t> Find(const IpPrefix& address) const {
+        const Family& family = address.v6 ? v6_ : v4_;
+        if (family.match_all != NO_RULE) { return family.match_all; }
+        if (family.nodes.empty()) { return nullopt; }
+        uint32_t node = 0;
+        for (size_t i = 0; i < address.ByteCount(); ++i) {
+            const Node& current = family.nodes[node];
+            const uint8_t b = address.bytes[i];
+            if (const uint32_t rule = current.RuleAt(b); rule != NO_RULE) { return rule; }
+            node = current.ChildAt(b);
+            if (node == 0) { return nullopt; }
+        }
+        return nullopt;
+    }
+
+private:
+    static constexpr uint32_t NO_RULE = numeric_limits<uint32_t>::max();
+
+    struct Child {
+        uint8_t byte;
+        uint32_t node;
+    };
+
+    // Правило для байтов first..last: префикс, который кончается внутри этого байта.
+    struct RuleRange {
+        uint8_t first;
+        uint8_t last;
+        uint32_t rule;
+    };
+
+    // Узел 0 — корень, поэтому 0 означает «нет ребёнка».
+    // Почти все узлы разреженные (несколько детей и правил на 256 возможных байтов),
+    // поэтому вместо плотных таблиц — отсортированные векторы с бинарным поиском.
+    struct Node {
+        vector<Child> children;  // по возрастанию byte
+        vector<RuleRange> rules; // непересекающиеся, по возрастанию first
+
+        uint32_t ChildAt(uint8_t b) const {
+            const auto it = lower_bound(children.begin(), children.end(), b,
+                                        [](const Child& child, uint8_t value) { return child.byte < value; });
+            return it != children.end() && it->byte == b ? it->node : 0;
+        }
+
+        void AddChild(uint8_t b, uint32_t node) {
+            const auto it = lower_bound(children.begin(), children.end(), b,
+                                        [](const Child& child, uint8_t value) { return child.byte < value; });
+            children.insert(it, Child{b, node});
+        }
+
+        uint32_t RuleAt(uint8_t b) const {
+            auto it = upper_bound(rules.begin(), rules.end(), b,
+                                  [](uint8_t value, const RuleRange& range) { return value < range.first; });
+            if (it == rules.begin()) { return NO_RULE; }
+            --it;
+            return b <= it->last ? it->rule : NO_RULE;
+        }
+
+        // Байты, уже занятые более ранним правилом, за ним и остаются;
+        // новое правило получает только промежутки между ними.
+        void AddRule(uint8_t first, uint8_t last, uint32_t rule) {
+            vector<RuleRange> result;
+            result.reserve(rules.size() + 2);
+            unsigned next = first;
+            for (const RuleRange& range : rules) {
+                if (next <= last && next < range.first) {
+                    result.push_back(RuleRange{static_cast<uint8_t>(next),
+                                               static_cast<uint8_t>(min<unsigned>(last, range.first - 1u)), rule});
+                }
+                result.push_back(range);
+                next = max<unsigned>(next, range.last + 1u);
+            }
+            if (next <= last) {
+                result.push_back(RuleRange{static_cast<uint8_t>(next), last, rule});
+            }
+            rules = move(result);
+        }
+    };
+
+    struct Family {
+        uint32_t match_all = NO_RULE;
+        vector<Node> nodes;
+    };
+
+    Family v4_;
+    Family v6_;
 };
 
 // Проверяет, запрещён ли домен или его супердомен.
@@ -66,9 +501,15 @@ public:
     // Конструктор: заполняет множество обращённых доменов из диапазона [begin, end).
     // Использует GetReversed() для получения ключа.
     // Быстро проверяет поддомены за счёт поиска в set.
+    // IP-адреса и CIDR-префиксы из списка попадают в отдельный IpPrefixMatcher.
+    // Номер правила — позиция домена в диапазоне; у повторов остаётся первый номер.
     DomainChecker(Iterator begin, Iterator end) {
-        while (begin != end) {
-            forbidden_reversed_.insert((begin++)->GetReversed());
+        for (uint32_t rule_id = 0; begin != end; ++begin, ++rule_id) {
+            if (const auto& ip = begin->GetIp()) {
+                ip_matcher_.Insert(*ip, rule_id);
+            } else {
+                forbidden_reversed_.emplace(begin->GetReversed(), rule_id);
+            }
         }
     }
 
@@ -76,58 +517,3865 @@ public:
     // Собирает суффиксы домена по частям (в обратной записи) и ищет их в множестве.
     // Например: для "ru.gdz.math" проверяет "ru", "ru.gdz", "ru.gdz.math".
     bool IsForbidden(const Domain& domain) const {
-        const string& rev = domain.GetReversed();
-        stringstream ss(rev);
-        string part;
-        string suffix;
+        return FindRule(domain).has_value();
+    }
+
+    // То же, что IsForbidden, но возвращает номер сработавшего правила:
+    // самого короткого запрещённого супердомена, а для IP — правила IpPrefixMatcher::Find.
+    optional<uint32_t> FindRule(const Domain& domain) const {
+        const size_t length = domain.GetReversed().size();
+        TRACE_POINT1(query__begin, length);
+        optional<uint32_t> rule;
+        uint32_t probes = 1;
+        if (const auto& ip = domain.GetIp()) {
+            rule = ip_matcher_.Find(*ip);
+        } else {
+            probes = 0;
+            ForEachReversedSuffix(domain.GetReversed(), [this, &rule, &probes](string_view suffix) {
+                ++probes;
+                const auto it = forbidden_reversed_.find(suffix);
+                if (it == forbidden_reversed_.end()) { return false; }
+                rule = it->second;
+                return true;
+            });
+        }
+        if (rule) {
+            TRACE_POINT2(match, *rule, probes);
+        }
+        TRACE_POINT3(query__end, length, probes, rule ? static_cast<int64_t>(*rule) : int64_t{-1});
+        return rule;
+    }
+
+    // Проверяет, есть ли в множестве ровно этот обращённый домен (без учёта супердоменов).
+    // Нужен для составных проверщиков, которые сами обходят суффиксы.
+    bool Contains(string_view reversed) const {
+        return forbidden_reversed_.find(reversed) != forbidden_reversed_.end();
+    }
+
+    // Узел красно-чёрного дерева map: цвет и три указателя плюс сама пара.
+    MemoryBreakdown MemoryUsage() const {
+        constexpr size_t NODE_HEADER = 4 * sizeof(void*);
+        MemoryBreakdown usage;
+        usage.Add("map nodes"sv, forbidden_reversed_.size() * (NODE_HEADER + sizeof(decltype(forbidden_reversed_)::value_type)));
+        size_t keys = 0;
+        for (const auto& [key, rule_id] : forbidden_reversed_) {
+            keys += HeapBytes(key);
+        }
+        usage.Add("key strings"sv, keys);
+        usage.Add("ip trie"sv, ip_matcher_.MemoryUsage());
+        return usage;
+    }
 
-        // getline(ss, part, '.')
-        // Читает символы из ss пока не встретит '.' или конец строки.
-        // Считанная часть (без точки!) записывается в part.
-        while (getline(ss, part, '.')) {
-            if (!suffix.empty()) { suffix += '.'; } 
-            suffix += part;
-            if (forbidden_reversed_.count(suffix)) { return true; }
+    // Вызывает f(reversed) для каждого запрещённого домена в поддереве root: сам root и его поддомены.
+    // Запрещённые предки root не перечисляются. Результаты идут потоком, без сбора в контейнер.
+    // В обычном порядке строк поддомены "ru.gdz." занимают непрерывный диапазон множества,
+    // поэтому достаточно двух поисков и прохода по этому диапазону.
+    template <typename Func>
+    void ForEachForbiddenUnder(const Domain& root, Func f) const {
+        const string& rev = root.GetReversed();
+        if (Contains(rev)) {
+            f(string_view(rev));
+        }
+        const string prefix = rev + '.';
+        for (auto it = forbidden_reversed_.lower_bound(prefix);
+             it != forbidden_reversed_.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            f(string_view(it->first));
         }
-        return false;
     }
 
 private:
-    set<string> forbidden_reversed_;
+    // Обращённый домен → номер правила.
+    // less<> позволяет искать по string_view без создания временной строки.
+    map<string, uint32_t, less<>> forbidden_reversed_;
+    IpPrefixMatcher ip_matcher_;
 };
 
-namespace {
+// Проверщик для одного арендатора (tenant) поверх общего базового списка.
+// Базовый DomainChecker неизменяем и разделяется всеми арендаторами через shared_ptr,
+// а у арендатора хранится только маленькая дельта: свои запрещённые домены и исключения.
+// Поэтому память растёт с размером дельты, а не базы.
+// За один проход по суффиксам опрашиваются и база, и дельта; побеждает самое длинное
+// (самое конкретное) совпадение. На одном уровне исключение арендатора сильнее запрета.
+class OverlayDomainChecker {
+public:
+    template <typename Iterator>
+    OverlayDomainChecker(shared_ptr<const DomainChecker> base,
+                         Iterator added_begin, Iterator added_end,
+                         Iterator exceptions_begin, Iterator exceptions_end)
+        : base_(move(base))
+        , added_(added_begin, added_end)
+        , exceptions_(exceptions_begin, exceptions_end) {}
 
-// Читает из потока указанное количество доменов (по одному на строке).
-// Создаёт объекты Domain и возвращает вектор.
-// Используется для чтения как запрещённых, так и проверяемых доменов.
-vector<Domain> ReadDomains(istream& input, size_t count) {
-    vector<Domain> domains;
-    domains.reserve(count);
-    string line;
-    for (size_t i = 0; i < count; ++i) {
-        getline(input, line);
-        // Удаляем \r, если есть (для Windows)
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
+    // Невалидные имена не запрещаются, как и в основном режиме проверки.
+    // IP-литералы идут через IP-матчеры: исключение арендатора покрывает адрес целиком,
+    // иначе действуют его запреты и базовые IP-адреса и CIDR-префиксы.
+    bool IsForbidden(const Domain& domain) const {
+        if (!domain.IsValid()) {
+            return false;
         }
-        domains.emplace_back(line);
+        if (domain.GetIp()) {
+            return !exceptions_.FindRule(domain) && (added_.FindRule(domain) || base_->FindRule(domain));
+        }
+        bool forbidden = false;
+        ForEachReversedSuffix(domain.GetReversed(), [&](string_view suffix) {
+            if (exceptions_.Contains(suffix)) {
+                forbidden = false;
+            } else if (added_.Contains(suffix) || base_->Contains(suffix)) {
+                forbidden = true;
+            }
+            return false;
+        });
+        return forbidden;
     }
-    return domains;
+
+    // База учитывается целиком, хотя её делят все арендаторы.
+    MemoryBreakdown MemoryUsage() const {
+        MemoryBreakdown usage;
+        usage.Add("shared base"sv, base_->MemoryUsage().Total());
+        usage.Add("tenant additions"sv, added_.MemoryUsage().Total());
+        usage.Add("tenant exceptions"sv, exceptions_.MemoryUsage().Total());
+        return usage;
+    }
+
+private:
+    shared_ptr<const DomainChecker> base_;
+    DomainChecker added_;
+    DomainChecker exceptions_;
+};
+
+// Персистентный (copy-on-write) бор доменов.
+// Каждая вставка или удаление копирует только узлы на пути к изменённой метке,
+// а всё остальное разделяется со старой версией. Поэтому копия объекта —
+// это неизменяемый снимок версии за O(1): читатель может держать старую версию,
+// не копируя всю структуру.
+// Дети одного узла хранятся в декартовом дереве (treap) по метке, чтобы путь
+// в узле с миллионами детей (например, "com") оставался логарифмическим.
+class PersistentDomainTrie {
+public:
+    PersistentDomainTrie Insert(const Domain& domain) const {
+        const vector<string_view> labels = SplitLabels(domain.GetReversed());
+        bool inserted = false;
+        PersistentDomainTrie result;
+        result.root_ = InsertLabels(root_, labels, 0, inserted);
+        result.size_ = size_ + (inserted ? 1 : 0);
+        return result;
+    }
+
+    PersistentDomainTrie Erase(const Domain& domain) const {
+        const vector<string_view> labels = SplitLabels(domain.GetReversed());
+        bool erased = false;
+        PersistentDomainTrie result;
+        result.root_ = EraseLabels(root_, labels, 0, erased);
+        result.size_ = size_ - (erased ? 1 : 0);
+        return result;
+    }
+
+    // Спускается по меткам от TLD; как только встречает запрещённый узел — домен запрещён.
+    bool IsForbidden(const Domain& domain) const {
+        string_view rest = domain.GetReversed();
+        const Node* siblings = root_.get();
+        while (true) {
+            const size_t dot = rest.find('.');
+            const Node* node = FindLabel(siblings, rest.substr(0, dot));
+            if (node == nullptr) { return false; }
+            if (node->forbidden) { return true; }
+            if (dot == string_view::npos) { return false; }
+            rest.remove_prefix(dot + 1);
+            siblings = node->child.get();
+        }
+    }
+
+    // Есть ли в боре ровно этот домен, а не только один из его предков.
+    bool Contains(string_view reversed) const {
+        const Node* siblings = root_.get();
+        while (true) {
+            const size_t dot = reversed.find('.');
+            const Node* node = FindLabel(siblings, reversed.substr(0, dot));
+            if (node == nullptr) { return false; }
+            if (dot == string_view::npos) { return node->forbidden; }
+            reversed.remove_prefix(dot + 1);
+            siblings = node->child.get();
+        }
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Вызывает f(reversed) для каждого запрещённого домена в порядке ReversedLess.
+    template <typename Func>
+    void ForEach(Func f) const {
+        string prefix;
+        ForEachIn(root_.get(), prefix, f);
+    }
+
+    // Память этой версии. Узлы, общие со старыми версиями, тоже учитываются.
+    // Узел из make_shared лежит в одном блоке со счётчиками ссылок (ещё два слова и vptr).
+    MemoryBreakdown MemoryUsage() const {
+        constexpr size_t CONTROL_BLOCK = sizeof(void*) + 2 * sizeof(int);
+        size_t nodes = 0;
+        size_t labels = 0;
+        CountMemory(root_.get(), nodes, labels);
+        MemoryBreakdown usage;
+        usage.Add("nodes"sv, nodes * (CONTROL_BLOCK + sizeof(Node)));
+        usage.Add("labels"sv, labels);
+        return usage;
+    }
+
+private:
+    struct Node;
+    using NodePtr = shared_ptr<const Node>;
+
+    // Узел одновременно элемент treap среди братьев (left/right/priority)
+    // и вершина бора (child — корень treap его детей).
+    struct Node {
+        string label;
+        size_t priority = 0;
+        bool forbidden = false;
+        NodePtr left;
+        NodePtr right;
+        NodePtr child;
+    };
+
+    template <typename Func>
+    static void ForEachIn(const Node* node, string& prefix, Func& f) {
+        if (node == nullptr) { return; }
+        ForEachIn(node->left.get(), prefix, f);
+        const size_t old_size = prefix.size();
+        if (old_size != 0) { prefix += '.'; }
+        prefix += node->label;
+        if (node->forbidden) { f(string_view(prefix)); }
+        ForEachIn(node->child.get(), prefix, f);
+        prefix.resize(old_size);
+        ForEachIn(node->right.get(), prefix, f);
+    }
+
+    static void CountMemory(const Node* node, size_t& nodes, size_t& labels) {
+        if (node == nullptr) { return; }
+        ++nodes;
+        labels += HeapBytes(node->label);
+        CountMemory(node->left.get(), nodes, labels);
+        CountMemory(node->right.get(), nodes, labels);
+        CountMemory(node->child.get(), nodes, labels);
+    }
+
+    static vector<string_view> SplitLabels(string_view rev) {
+        vector<string_view> labels;
+        ForEachReversedSuffix(rev, [&](string_view suffix) {
+            const size_t start = labels.empty() ? 0 : suffix.rfind('.') + 1;
+            labels.push_back(suffix.substr(start));
+            return false;
+        });
+        return labels;
+    }
+
+    static const Node* FindLabel(const Node* node, string_view label) {
+        while (node != nullptr && node->label != label) {
+            node = label < node->label ? node->left.get() : node->right.get();
+        }
+        return node;
+    }
+
+    // Возвращает новый корень treap братьев; все изменённые узлы свежие,
+    // поэтому их можно поворачивать на месте.
+    static shared_ptr<Node> InsertLabels(const NodePtr& node, const vector<string_view>& labels,
+                                         size_t i, bool& inserted) {
+        const string_view label = labels[i];
+        const bool last = i + 1 == labels.size();
+        if (!node) {
+            auto fresh = make_shared<Node>();
+            fresh->label = string(label);
+            fresh->priority = hash<string_view>{}(label);
+            if (last) {
+                fresh->forbidden = inserted = true;
+            } else {
+                fresh->child = InsertLabels(nullptr, labels, i + 1, inserted);
+            }
+            return fresh;
+        }
+
+        auto copy = make_shared<Node>(*node);
+        if (label < node->label) {
+            auto left = InsertLabels(node->left, labels, i, inserted);
+            copy->left = left;
+            if (left->priority > copy->priority) {
+                copy->left = left->right;
+                left->right = copy;
+                return left;
+            }
+        } else if (node->label < label) {
+            auto right = InsertLabels(node->right, labels, i, inserted);
+            copy->right = right;
+            if (right->priority > copy->priority) {
+                copy->right = right->left;
+                right->left = copy;
+                return right;
+            }
+        } else if (last) {
+            inserted = !copy->forbidden;
+            copy->forbidden = true;
+        } else {
+            copy->child = InsertLabels(node->child, labels, i + 1, inserted);
+        }
+        return copy;
+    }
+
+    // Если метки нет, возвращает исходный узел без копирования.
+    static NodePtr EraseLabels(const NodePtr& node, const vector<string_view>& labels,
+                               size_t i, bool& erased) {
+        if (!node) { return node; }
+        const string_view label = labels[i];
+        if (label != node->label) {
+            const bool go_left = label < node->label;
+            NodePtr sub = EraseLabels(go_left ? node->left : node->right, labels, i, erased);
+            if (!erased) { return node; }
+            auto copy = make_shared<Node>(*node);
+            (go_left ? copy->left : copy->right) = move(sub);
+            return copy;
+        }
+
+        auto copy = make_shared<Node>(*node);
+        if (i + 1 == labels.size()) {
+            erased = copy->forbidden;
+            copy->forbidden = false;
+        } else {
+            copy->child = EraseLabels(node->child, labels, i + 1, erased);
+        }
+        if (!erased) { return node; }
+        // Узел без запрета и без детей больше не нужен — сливаем его поддеревья.
+        if (!copy->forbidden && !copy->child) {
+            return Merge(copy->left, copy->right);
+        }
+        return copy;
+    }
+
+    static NodePtr Merge(const NodePtr& left, const NodePtr& right) {
+        if (!left) { return right; }
+        if (!right) { return left; }
+        if (left->priority > right->priority) {
+            auto copy = make_shared<Node>(*left);
+            copy->right = Merge(left->right, right);
+            return copy;
+        }
+        auto copy = make_shared<Node>(*right);
+        copy->left = Merge(left, right->left);
+        return copy;
+    }
+
+    NodePtr root_;
+    size_t size_ = 0;
+};
+
+// Запись журнала упреждающей записи (WAL) или файла дельты: по одной на строке,
+// "+ домен" — добавить запрет, "- домен" — снять.
+struct LogRecord {
+    bool add = true;
+    string domain;
+};
+
+// Изменяемый проверщик на основе PersistentDomainTrie, хранящий последние версии.
+// Каждое изменение создаёт новую версию; старые остаются доступны для отката,
+// пока их не больше max_versions. Snapshot() отдаёт текущую версию за O(1),
+// и читатель может пользоваться ею, не мешая писателю.
+// Писатели выстраиваются в очередь на write_mutex_ и строят новую версию без
+// блокировки читателей; mutex_ берётся только на копирование или публикацию версии.
+class VersionedDomainChecker {
+public:
+    explicit VersionedDomainChecker(size_t max_versions)
+        : max_versions_(max(max_versions, size_t{1}))
+        , versions_(1) {}
+
+    void Add(const Domain& domain) {
+        lock_guard write(write_mutex_);
+        Commit(Snapshot().Insert(domain));
+    }
+
+    void Remove(const Domain& domain) {
+        lock_guard write(write_mutex_);
+        Commit(Snapshot().Erase(domain));
+    }
+
+    PersistentDomainTrie Snapshot() const {
+        lock_guard lock(mutex_);
+        return versions_.back();
+    }
+
+    bool IsForbidden(const Domain& domain) const {
+        return Snapshot().IsForbidden(domain);
+    }
+
+    // Применяет пачку записей журнала как одну новую версию,
+    // чтобы большая дельта не вытесняла историю для отката.
+    void Apply(const vector<LogRecord>& records) {
+        lock_guard write(write_mutex_);
+        PersistentDomainTrie version = Snapshot();
+        for (const LogRecord& record : records) {
+            const Domain domain(record.domain);
+            version = record.add ? version.Insert(domain) : version.Erase(domain);
+        }
+        Commit(move(version));
+    }
+
+    // Делает version текущей версией (например, после загрузки снимка с диска).
+    void Reset(PersistentDomainTrie version) {
+        lock_guard write(write_mutex_);
+        Commit(move(version));
+    }
+
+    // Откатывается на steps версий назад. Возвращает false, если столько версий не сохранилось.
+    bool Rollback(size_t steps = 1) {
+        lock_guard write(write_mutex_);
+        lock_guard lock(mutex_);
+        if (steps >= versions_.size()) { return false; }
+        versions_.resize(versions_.size() - steps);
+        return true;
+    }
+
+    size_t VersionCount() const {
+        lock_guard lock(mutex_);
+        return versions_.size();
+    }
+
+private:
+    // Вытесненная версия освобождается уже после снятия блокировки:
+    // разбор её узлов не должен задерживать читателей.
+    void Commit(PersistentDomainTrie version) {
+        PersistentDomainTrie evicted;
+        {
+            lock_guard lock(mutex_);
+            versions_.push_back(move(version));
+            if (versions_.size() > max_versions_) {
+                evicted = move(versions_.front());
+                versions_.pop_front();
+            }
+        }
+    }
+
+    size_t max_versions_;
+    mutex write_mutex_;
+    mutable mutex mutex_;
+    deque<PersistentDomainTrie> versions_;
+};
+
+// Как готовить отображённый файл к запросам.
+struct MapOptions {
+    // Подгрузить все страницы до возврата из конструктора, чтобы первые запросы
+    // после загрузки не спотыкались о page fault.
+    bool prefault = false;
+    // Закрепить страницы в памяти (mlock), чтобы их не вытеснило под нагрузкой.
+    // Если не хватает RLIMIT_MEMLOCK, файл всё равно отображается, а Locked() вернёт false.
+    bool lock = false;
+    // Сколько потоков касаются страниц при prefault; при 1 используется MAP_POPULATE.
+    size_t prefault_threads = thread::hardware_concurrency();
+};
+
+// Отображает файл в память только для чтения. Пустой файл даёт пустые данные.
+class MappedFile {
+public:
+    explicit MappedFile(const string& path, const MapOptions& options = {}) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("cannot open "s + path + ": " + strerror(errno));
+        }
+        const bool populate = options.prefault && options.prefault_threads <= 1;
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size_ = static_cast<size_t>(st.st_size);
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+        }
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            throw runtime_error("cannot mmap "s + path + ": " + strerror(errno));
+        }
+        if (size_ == 0) {
+            return;
+        }
+        if (options.prefault && !populate) {
+            madvise(data_, size_, MADV_WILLNEED);
+            TouchPages(options.prefault_threads);
+        }
+        if (options.lock) {
+            locked_ = mlock(data_, size_) == 0;
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (size_ != 0) {
+            munmap(data_, size_);
+        }
+    }
+
+    string_view Data() const {
+        return {static_cast<const char*>(data_), size_};
+    }
+
+    bool Locked() const {
+        return locked_;
+    }
+
+private:
+    // Читает по байту с каждой страницы, поделив файл между потоками.
+    void TouchPages(size_t threads) const {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t pages = (size_ + page - 1) / page;
+        threads = min(threads, pages);
+        const auto touch = [this, page, pages, threads](size_t part) {
+            const volatile char* data = static_cast<const char*>(data_);
+            char sink = 0;
+            for (size_t i = part * pages / threads; i < (part + 1) * pages / threads; ++i) {
+                sink ^= data[i * page];
+            }
+            (void)sink;
+        };
+        vector<thread> helpers;
+        for (size_t part = 1; part < threads; ++part) {
+            helpers.emplace_back(touch, part);
+        }
+        touch(0);
+        for (thread& helper : helpers) {
+            helper.join();
+        }
+    }
+
+    void* data_ = nullptr;
+    size_t size_ = 0;
+    bool locked_ = false;
+};
+
+// CRC32C (полином Кастаньоли) для контрольных сумм скомпилированного индекса.
+// На x86-64 с SSE4.2 считается инструкцией crc32 по 8 байт за раз, иначе — по таблице.
+// Вызовы сцепляются: Crc32c(b, Crc32c(a)) == Crc32c(a + b).
+namespace crc32c_detail {
+
+inline uint32_t Software(uint32_t crc, const unsigned char* data, size_t size) {
+    static const array<uint32_t, 256> table = [] {
+        array<uint32_t, 256> result{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? (value >> 1) ^ 0x82F63B78u : value >> 1;
+            }
+            result[i] = value;
+        }
+        return result;
+    }();
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
 }
 
-// Читает число с отдельной строки.
-// Использует stringstream для преобразования строки в число любого типа (size_t, int и т.д.).
-// Применяется для чтения количества доменов.
-template <typename Number>
-Number ReadNumberOnLine(istream& input) {
-    string line;
-    getline(input, line);
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t Hardware(uint32_t crc, const unsigned char* data, size_t size) {
+    uint64_t wide = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = static_cast<uint32_t>(wide);
+    for (; size > 0; ++data, --size) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+} // namespace crc32c_detail
+
+inline uint32_t Crc32c(string_view data, uint32_t crc = 0) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data.data());
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~crc32c_detail::Hardware(~crc, bytes, data.size());
+    }
+#endif
+    return ~crc32c_detail::Software(~crc, bytes, data.size());
+}
+
+// Когда проверять контрольные суммы данных индекса при открытии.
+// Заголовок, таблица секций и список сумм проверяются всегда, кроме NONE.
+enum class IndexVerification {
+    NONE,   // доверять файлу (например, только что собранному в этом же процессе)
+    FULL,   // проверить все блоки сразу, параллельно
+    LAZY,   // проверять блок при первом обращении к нему: старт как у простого mmap
+};
+
+// Скомпилированный индекс запрещённых доменов, пригодный для mmap.
+// Формат (числа little-endian):
+//   заголовок 32 байта — магия "DCINDEX\0", версия формата (uint32), число секций (uint32),
+//     число ключей n (uint64), CRC32C заголовка (uint32), число блоков данных (uint32);
+//   таблица секций — вид (uint32), номер первого блока (uint32), смещение и размер (uint64);
+//   CRC32C каждого блока данных (секции режутся на блоки по 1 МиБ);
+//   секции с выравниванием 8: OFFSETS — n + 1 смещений (uint64),
+//     KEYS — склеенные обращённые домены, отсортированные по ReversedLess.
+// CRC заголовка покрывает заголовок, таблицу и суммы блоков, поэтому повреждённый
+// или чужой файл отвергается до первого поиска и не может уронить процесс.
+// Проверка идёт бинарным поиском прямо по байтам файла, без разбора и построения структур.
+class CompiledDomainIndex {
+public:
+    static constexpr string_view MAGIC = "DCINDEX\0"sv;
+    static constexpr uint32_t FORMAT_VERSION = 2;
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    // Собирает байты индекса из диапазона доменов (порядок и повторы не важны).
+    template <typename Iterator>
+    static string Compile(Iterator begin, Iterator end) {
+        vector<string> keys;
+        for (; begin != end; ++begin) {
+            keys.push_back(begin->GetReversed());
+        }
+        sort(keys.begin(), keys.end(), ReversedLess);
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        return Build(keys);
+    }
+
+    // Собирает байты индекса из ключей, уже отсортированных по ReversedLess без повторов.
+    static string Build(const vector<string>& sorted_reversed) {
+        string offsets;
+        uint64_t offset = 0;
+        for (const string& key : sorted_reversed) {
+            AppendU64(offsets, offset);
+            offset += key.size();
+        }
+        AppendU64(offsets, offset);
+        string keys;
+        keys.reserve(offset);
+        for (const string& key : sorted_reversed) {
+            keys += key;
+        }
+
+        const array<pair<uint32_t, string_view>, 2> sections = {{{SECTION_OFFSETS, offsets}, {SECTION_KEYS, keys}}};
+        vector<uint32_t> first_chunks;
+        vector<uint32_t> chunk_crcs;
+        for (const auto& [kind, section] : sections) {
+            first_chunks.push_back(static_cast<uint32_t>(chunk_crcs.size()));
+            for (size_t pos = 0; pos < section.size(); pos += CHUNK_SIZE) {
+                chunk_crcs.push_back(Crc32c(section.substr(pos, CHUNK_SIZE)));
+            }
+        }
+
+        string bytes(MAGIC);
+        AppendU32(bytes, FORMAT_VERSION);
+        AppendU32(bytes, static_cast<uint32_t>(sections.size()));
+        AppendU64(bytes, sorted_reversed.size());
+        AppendU32(bytes, 0);  // CRC заголовка, заполняется ниже
+        AppendU32(bytes, static_cast<uint32_t>(chunk_crcs.size()));
+        uint64_t data_offset = AlignUp(HEADER_SIZE + sections.size() * SECTION_ENTRY_SIZE + chunk_crcs.size() * 4);
+        for (size_t i = 0; i < sections.size(); ++i) {
+            AppendU32(bytes, sections[i].first);
+            AppendU32(bytes, first_chunks[i]);
+            AppendU64(bytes, data_offset);
+            AppendU64(bytes, sections[i].second.size());
+            data_offset = AlignUp(data_offset + sections[i].second.size());
+        }
+        for (const uint32_t crc : chunk_crcs) {
+            AppendU32(bytes, crc);
+        }
+        const uint32_t header_crc = HeaderCrc(bytes);
+        memcpy(bytes.data() + HEADER_CRC_AT, &header_crc, sizeof(header_crc));
+        for (const auto& [kind, section] : sections) {
+            bytes.resize(AlignUp(bytes.size()), '\0');
+            bytes += section;
+        }
+        return bytes;
+    }
+
+    static CompiledDomainIndex Open(const string& path, const MapOptions& options = {},
+                                    IndexVerification verification = IndexVerification::FULL) {
+        auto file = make_shared<const MappedFile>(path, options);
+        const string_view data = file->Data();
+        CompiledDomainIndex index(file, data, verification);
+        index.locked_ = file->Locked();
+        return index;
+    }
+
+    static CompiledDomainIndex FromBytes(string bytes, IndexVerification verification = IndexVerification::FULL) {
+        auto owner = make_shared<const string>(move(bytes));
+        const string_view data = *owner;
+        return CompiledDomainIndex(move(owner), data, verification);
+    }
+
+    // IP-литерал совпадает только с таким же ключом: точки в нём не разделяют метки,
+    // а CIDR-префиксы индекс не разворачивает.
+    bool IsForbidden(const Domain& domain) const {
+        if (domain.GetIp()) {
+            return Contains(domain.GetReversed());
+        }
+        return IsForbiddenReversed(domain.GetReversed());
+    }
+
+    // Проверка по уже обращённой записи, без создания Domain (см. ReverseInto).
+    // В режиме LAZY бросает runtime_error, если затронутый блок повреждён.
+    bool IsForbiddenReversed(string_view reversed) const {
+        TRACE_POINT1(query__begin, reversed.size());
+        uint32_t probes = 0;
+        int64_t rule = -1;
+        ForEachReversedSuffix(reversed, [this, &probes, &rule](string_view suffix) {
+            ++probes;
+            const optional<size_t> pos = Find(suffix);
+            if (!pos) { return false; }
+            rule = static_cast<int64_t>(*pos);
+            return true;
+        });
+        if (rule >= 0) {
+            TRACE_POINT2(match, rule, probes);
+        }
+        TRACE_POINT3(query__end, reversed.size(), probes, rule);
+        return rule >= 0;
+    }
+
+    bool Contains(string_view reversed) const {
+        return Find(reversed).has_value();
+    }
+
+    // Вызывает f(reversed) для root и всех его запрещённых поддоменов.
+    // В порядке ReversedLess поддерево — непрерывный диапазон сразу за root,
+    // поэтому хватает одного бинарного поиска.
+    template <typename Func>
+    void ForEachForbiddenUnder(const Domain& root, Func f) const {
+        const string& rev = root.GetReversed();
+        for (size_t i = LowerBound(rev); i < count_; ++i) {
+            const string_view key = GetReversed(i);
+            if (!IsInSubtree(key, rev)) { break; }
+            f(key);
+        }
+    }
+
+    size_t Size() const {
+        return count_;
+    }
+
+    // Закреплены ли страницы индекса в памяти (см. MapOptions::lock).
+    bool IsLocked() const {
+        return locked_;
+    }
+
+    // Секции файла индекса и состояние ленивой проверки блоков.
+    // Для Open это страницы mmap, которые ядро может вытеснить, а не память кучи.
+    MemoryBreakdown MemoryUsage() const {
+        MemoryBreakdown usage;
+        usage.Add("offsets"sv, (count_ + 1) * sizeof(uint64_t));
+        usage.Add("keys"sv, blob_.size());
+        usage.Add("chunk verifier"sv, lazy_ ? lazy_->MemoryUsage() : 0);
+        return usage;
+    }
+
+    string_view GetReversed(size_t i) const {
+        if (lazy_) {
+            lazy_->EnsureRange(offsets_chunk_, i * 8, 16);
+        }
+        const uint64_t begin = ReadU64(offsets_ + i * 8);
+        const uint64_t end = ReadU64(offsets_ + (i + 1) * 8);
+        if (lazy_) {
+            lazy_->EnsureRange(keys_chunk_, begin, end - begin);
+        }
+        return blob_.substr(begin, end - begin);
+    }
+
+private:
+    static constexpr size_t HEADER_SIZE = 32;
+    static constexpr size_t HEADER_CRC_AT = 24;
+    static constexpr size_t SECTION_ENTRY_SIZE = 24;
+    static constexpr uint32_t SECTION_OFFSETS = 1;
+    static constexpr uint32_t SECTION_KEYS = 2;
+
+    // Позиция ключа, равного reversed, или nullopt.
+    optional<size_t> Find(string_view reversed) const {
+        const size_t pos = LowerBound(reversed);
+        if (pos == count_ || GetReversed(pos) != reversed) {
+            return nullopt;
+        }
+        return pos;
+    }
+
+    // Блоки данных с ожидаемыми суммами и отметками о том, какие уже проверены.
+    class ChunkVerifier {
+    public:
+        struct Chunk {
+            string_view data;
+            uint32_t crc = 0;
+        };
+
+        explicit ChunkVerifier(vector<Chunk> chunks)
+            : chunks_(move(chunks))
+            , verified_(make_unique<atomic<bool>[]>(chunks_.size())) {}
+
+        void Ensure(size_t chunk) const {
+            if (verified_[chunk].load(memory_order_acquire)) { return; }
+            if (Crc32c(chunks_[chunk].data) != chunks_[chunk].crc) {
+                throw runtime_error("compiled index chunk " + to_string(chunk) + " is corrupted");
+            }
+            verified_[chunk].store(true, memory_order_release);
+        }
+
+        // Проверяет блоки секции, начинающейся с блока first_chunk, покрывающие [pos, pos + size).
+        void EnsureRange(size_t first_chunk, size_t pos, size_t size) const {
+            if (size == 0) { return; }
+            for (size_t chunk = pos / CHUNK_SIZE; chunk <= (pos + size - 1) / CHUNK_SIZE; ++chunk) {
+                Ensure(first_chunk + chunk);
+            }
+        }
+
+        // Проверяет все блоки, раздавая их потокам через общий счётчик.
+        void VerifyAll(size_t threads) const {
+            atomic<size_t> next{0};
+            atomic<bool> corrupted{false};
+            const auto work = [&] {
+                for (size_t chunk = next++; chunk < chunks_.size(); chunk = next++) {
+                    if (Crc32c(chunks_[chunk].data) == chunks_[chunk].crc) {
+                        verified_[chunk].store(true, memory_order_release);
+                    } else {
+                        corrupted = true;
+                    }
+                }
+            };
+            vector<thread> helpers;
+            for (size_t i = 1; i < min(max(threads, size_t{1}), chunks_.size()); ++i) {
+                helpers.emplace_back(work);
+            }
+            work();
+            for (thread& helper : helpers) {
+                helper.join();
+            }
+            if (corrupted) {
+                throw runtime_error("compiled index checksum mismatch");
+            }
+        }
+
+        size_t MemoryUsage() const {
+            return chunks_.capacity() * sizeof(Chunk) + chunks_.size() * sizeof(atomic<bool>);
+        }
+
+    private:
+        vector<Chunk> chunks_;
+        unique_ptr<atomic<bool>[]> verified_;
+    };
+
+    CompiledDomainIndex(shared_ptr<const void> owner, string_view data, IndexVerification verification)
+        : owner_(move(owner)) {
+        if (data.size() < HEADER_SIZE || data.substr(0, MAGIC.size()) != MAGIC) {
+            throw runtime_error("bad compiled index header");
+        }
+        const uint32_t version = ReadU32(data.data() + 8);
+        if (version != FORMAT_VERSION) {
+            throw runtime_error("unsupported compiled index version " + to_string(version));
+        }
+        const uint32_t section_count = ReadU32(data.data() + 12);
+        count_ = ReadU64(data.data() + 16);
+        const uint32_t chunk_count = ReadU32(data.data() + 28);
+        const uint64_t table_end = HEADER_SIZE + uint64_t{section_count} * SECTION_ENTRY_SIZE + uint64_t{chunk_count} * 4;
+        if (table_end > data.size()) {
+            throw runtime_error("truncated compiled index");
+        }
+        if (verification != IndexVerification::NONE
+            && HeaderCrc(data.substr(0, table_end)) != ReadU32(data.data() + HEADER_CRC_AT)) {
+            throw runtime_error("compiled index header checksum mismatch");
+        }
+
+        const char* crcs = data.data() + HEADER_SIZE + section_count * SECTION_ENTRY_SIZE;
+        vector<ChunkVerifier::Chunk> chunks(chunk_count);
+        string_view offsets;
+        for (uint32_t i = 0; i < section_count; ++i) {
+            const char* entry = data.data() + HEADER_SIZE + i * SECTION_ENTRY_SIZE;
+            const uint32_t kind = ReadU32(entry);
+            const uint32_t first_chunk = ReadU32(entry + 4);
+            const uint64_t offset = ReadU64(entry + 8);
+            const uint64_t size = ReadU64(entry + 16);
+            const uint64_t section_chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+            if (offset > data.size() || size > data.size() - offset || first_chunk + section_chunks > chunk_count) {
+                throw runtime_error("truncated compiled index");
+            }
+            const string_view section = data.substr(offset, size);
+            for (uint64_t c = 0; c < section_chunks; ++c) {
+                chunks[first_chunk + c] = {section.substr(c * CHUNK_SIZE, CHUNK_SIZE), ReadU32(crcs + (first_chunk + c) * 4)};
+            }
+            if (kind == SECTION_OFFSETS) {
+                offsets = section;
+                offsets_chunk_ = first_chunk;
+            } else if (kind == SECTION_KEYS) {
+                blob_ = section;
+                keys_chunk_ = first_chunk;
+            }
+        }
+        if (offsets.size() % 8 != 0 || offsets.size() / 8 != count_ + 1) {
+            throw runtime_error("bad compiled index sections");
+        }
+        offsets_ = offsets.data();
+
+        auto verifier = make_shared<const ChunkVerifier>(move(chunks));
+        if (verification == IndexVerification::FULL) {
+            verifier->VerifyAll(thread::hardware_concurrency());
+        } else if (verification == IndexVerification::LAZY) {
+            lazy_ = move(verifier);
+            lazy_->EnsureRange(offsets_chunk_, count_ * 8, 8);
+        }
+        if (ReadU64(offsets_ + count_ * 8) != blob_.size()) {
+            throw runtime_error("truncated compiled index");
+        }
+    }
+
+    // CRC заголовка с таблицей секций и суммами блоков, без поля самой CRC.
+    static uint32_t HeaderCrc(string_view table) {
+        return Crc32c(table.substr(HEADER_CRC_AT + 4), Crc32c(table.substr(0, HEADER_CRC_AT)));
+    }
+
+    size_t LowerBound(string_view reversed) const {
+        size_t lo = 0;
+        size_t hi = count_;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (ReversedLess(GetReversed(mid), reversed)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    static uint64_t AlignUp(uint64_t value) {
+        return (value + 7) & ~uint64_t{7};
+    }
+
+    static void AppendU32(string& out, uint32_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void AppendU64(string& out, uint64_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // Данные в mmap не обязательно выровнены, поэтому читаем через memcpy.
+    static uint32_t ReadU32(const char* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint64_t ReadU64(const char* p) {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    shared_ptr<const void> owner_;
+    // Не пуст только в режиме LAZY: тогда каждое обращение к данным сначала проверяет свой блок.
+    shared_ptr<const ChunkVerifier> lazy_;
+    bool locked_ = false;
+    size_t count_ = 0;
+    const char* offsets_ = nullptr;
+    string_view blob_;
+    size_t offsets_chunk_ = 0;
+    size_t keys_chunk_ = 0;
+};
+
+// Проверяет пакет доменов по индексу, записывая в verdicts[i] значение CHECKER_VERDICT_*.
+// Строки разбираются так же, как в остальных режимах (Domain): завершающая точка
+// отбрасывается, IP-литералы не обращаются, а не-имя хоста получает CHECKER_VERDICT_INVALID.
+// Возвращает число запрещённых. Буферы разбора живут в потоке,
+// поэтому после прогрева пакет проверяется без выделений памяти.
+inline int64_t CheckBatch(const CompiledDomainIndex& index, const char* const* domains, const size_t* lengths,
+                          size_t count, uint8_t* verdicts) {
+    thread_local string line;
+    thread_local Domain domain = Domain::FromReversed({});
+    TRACE_POINT1(batch__begin, count);
+    int64_t matches = 0;
+    for (size_t i = 0; i < count; ++i) {
+        line.assign(domains[i], lengths[i]);
+        domain.Assign(line);
+        if (!domain.IsValid()) {
+            verdicts[i] = CHECKER_VERDICT_INVALID;
+            continue;
+        }
+        const bool forbidden = index.IsForbidden(domain);
+        verdicts[i] = forbidden ? CHECKER_VERDICT_BAD : CHECKER_VERDICT_GOOD;
+        matches += forbidden;
+    }
+    TRACE_POINT2(batch__end, count, matches);
+    return matches;
+}
+
+inline void WriteLogRecord(ostream& output, const LogRecord& record) {
+    output << (record.add ? '+' : '-') << ' ' << record.domain << '\n';
+}
+
+// Читает записи журнала и передаёт их в f. Последняя строка без '\n' считается
+// недописанной при сбое и пропускается. Возвращает число прочитанных записей.
+template <typename Func>
+size_t ReadLogRecords(istream& input, Func f) {
+    size_t count = 0;
+    string line;
+    while (getline(input, line)) {
+        if (input.eof()) { break; }
+        if (line.size() < 3 || (line[0] != '+' && line[0] != '-') || line[1] != ' ') {
+            throw runtime_error("bad log record: " + line);
+        }
+        f(LogRecord{line[0] == '+', line.substr(2)});
+        ++count;
+    }
+    return count;
+}
+
+// Применяет записи журнала к изменяемому проверщику.
+inline size_t ReplayLog(istream& input, VersionedDomainChecker& checker) {
+    return ReadLogRecords(input, [&checker](const LogRecord& record) {
+        if (record.add) {
+            checker.Add(Domain(record.domain));
+        } else {
+            checker.Remove(Domain(record.domain));
+        }
+    });
+}
+
+// Вычисляет дельту между двумя версиями списка слиянием за линейное время.
+// Оба списка — обращённые домены, отсортированные по ReversedLess без повторов.
+// Для каждого удалённого и добавленного домена вызывает emit(LogRecord), в порядке ключей.
+template <typename Func>
+void DiffSortedReversed(const vector<string>& old_keys, const vector<string>& new_keys, Func emit) {
+    size_t i = 0;
+    size_t j = 0;
+    while (i < old_keys.size() || j < new_keys.size()) {
+        if (j == new_keys.size() || (i < old_keys.size() && ReversedLess(old_keys[i], new_keys[j]))) {
+            emit(LogRecord{false, Domain::FromReversed(old_keys[i++]).ToString()});
+        } else if (i == old_keys.size() || ReversedLess(new_keys[j], old_keys[i])) {
+            emit(LogRecord{true, Domain::FromReversed(new_keys[j++]).ToString()});
+        } else {
+            ++i;
+            ++j;
+        }
+    }
+}
+
+enum class SetOperation {
+    UNION,
+    INTERSECTION,
+    DIFFERENCE,
+};
+
+namespace detail {
+
+// Убирает домены, уже покрытые предком из того же списка.
+// В порядке ReversedLess поддерево идёт сразу за корнем, поэтому хватает последнего оставленного.
+inline vector<string_view> Minimize(const string* begin, const string* end) {
+    vector<string_view> result;
+    for (; begin != end; ++begin) {
+        if (result.empty() || !IsInSubtree(*begin, result.back())) {
+            result.push_back(*begin);
+        }
+    }
+    return result;
+}
+
+// Одно слияние двух минимизированных списков.
+// После минимизации предок элемента из другого списка — это последний встреченный
+// элемент того списка: всё между ними лежало бы в поддереве предка.
+// При равных ключах первым идёт элемент rhs, и тогда ключ lhs считается им покрытым.
+inline vector<string> CombineRange(const string* lhs_begin, const string* lhs_end,
+                                   const string* rhs_begin, const string* rhs_end, SetOperation op) {
+    const vector<string_view> lhs = Minimize(lhs_begin, lhs_end);
+    const vector<string_view> rhs = Minimize(rhs_begin, rhs_end);
+    vector<string> result;
+    string_view last_lhs;
+    string_view last_rhs;
+    bool has_lhs = false;
+    bool has_rhs = false;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < lhs.size() || j < rhs.size()) {
+        const bool take_lhs = j == rhs.size() || (i < lhs.size() && ReversedLess(lhs[i], rhs[j]));
+        const string_view key = take_lhs ? lhs[i++] : rhs[j++];
+        const bool covered_by_other = take_lhs ? has_rhs && IsInSubtree(key, last_rhs)
+                                               : has_lhs && IsInSubtree(key, last_lhs);
+        (take_lhs ? last_lhs : last_rhs) = key;
+        (take_lhs ? has_lhs : has_rhs) = true;
+
+        bool keep = false;
+        switch (op) {
+        case SetOperation::UNION:
+            keep = !covered_by_other;
+            break;
+        case SetOperation::INTERSECTION:
+            keep = covered_by_other;
+            break;
+        case SetOperation::DIFFERENCE:
+            keep = take_lhs && !covered_by_other;
+            break;
+        }
+        if (keep) {
+            result.emplace_back(key);
+        }
+    }
+    return result;
+}
+
+} // namespace detail
+
+// Объединение, пересечение и разность списков обращённых доменов с семантикой поддеревьев:
+// домен покрывает все свои поддомены. Оба списка отсортированы по ReversedLess.
+// Результат минимизирован (без покрытых потомков) и готов для CompiledDomainIndex::Build.
+// Поддерево не пересекает границу TLD, поэтому списки режутся по TLD на части,
+// которые сливаются параллельно на threads потоках.
+// Разность не умеет вырезать «дыры»: если в rhs есть поддомен домена из lhs,
+// домен из lhs остаётся, а rhs можно подключить исключениями через OverlayDomainChecker.
+inline vector<string> CombineSortedReversed(const vector<string>& lhs, const vector<string>& rhs,
+                                            SetOperation op, size_t threads = thread::hardware_concurrency()) {
+    threads = max(threads, size_t{1});
+    vector<string> splitters;
+    for (size_t part = 1; part < threads; ++part) {
+        const vector<string>& source = lhs.size() >= rhs.size() ? lhs : rhs;
+        if (source.empty()) { break; }
+        const string& key = source[part * source.size() / threads];
+        string tld = key.substr(0, key.find('.'));
+        if (splitters.empty() || ReversedLess(splitters.back(), tld)) {
+            splitters.push_back(move(tld));
+        }
+    }
+
+    vector<future<vector<string>>> parts;
+    const string* lhs_begin = lhs.data();
+    const string* rhs_begin = rhs.data();
+    for (size_t part = 0; part <= splitters.size(); ++part) {
+        const string* lhs_end = lhs.data() + lhs.size();
+        const string* rhs_end = rhs.data() + rhs.size();
+        if (part < splitters.size()) {
+            lhs_end = lhs.data() + (lower_bound(lhs.begin(), lhs.end(), splitters[part], ReversedLess) - lhs.begin());
+            rhs_end = rhs.data() + (lower_bound(rhs.begin(), rhs.end(), splitters[part], ReversedLess) - rhs.begin());
+        }
+        parts.push_back(async(launch::async, detail::CombineRange, lhs_begin, lhs_end, rhs_begin, rhs_end, op));
+        lhs_begin = lhs_end;
+        rhs_begin = rhs_end;
+    }
+
+    vector<string> result;
+    for (auto& part : parts) {
+        vector<string> keys = part.get();
+        move(keys.begin(), keys.end(), back_inserter(result));
+    }
+    return result;
+}
+
+// Записывает файл целиком: во временный файл, fsync, затем атомарный rename.
+inline void WriteFileAtomically(const string& path, string_view bytes) {
+    const string tmp_path = path + ".tmp";
+    const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw runtime_error("cannot create "s + tmp_path + ": " + strerror(errno));
+    }
+    while (!bytes.empty()) {
+        const ssize_t written = write(fd, bytes.data(), bytes.size());
+        if (written < 0) {
+            if (errno == EINTR) { continue; }
+            close(fd);
+            throw runtime_error("cannot write "s + tmp_path + ": " + strerror(errno));
+        }
+        bytes.remove_prefix(static_cast<size_t>(written));
+    }
+    fsync(fd);
+    close(fd);
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        throw runtime_error("cannot rename "s + tmp_path + ": " + strerror(errno));
+    }
+}
+
+// Изменяемый индекс, переживающий перезапуск.
+// Состояние = снимок в формате CompiledDomainIndex + журнал изменений после него.
+// Запросы обслуживаются прямо из отображённого снимка, а доигранные и новые записи
+// журнала лежат в небольшой дельте поверх него. Поэтому перезапуск стоит O(размер журнала),
+// а не перестройку всего списка в куче.
+// Каждое изменение сначала дописывается в журнал (с fdatasync), потом применяется.
+// Checkpoint() сохраняет новый снимок и обнуляет журнал и дельту.
+class DurableDomainIndex {
+public:
+    // Неизменяемое состояние индекса: снимок и дельта поверх него.
+    // Копируется за O(1), поэтому читатель берёт его один раз и не мешает писателю.
+    class View {
+    public:
+        bool IsForbidden(const Domain& domain) const {
+            bool forbidden = false;
+            ForEachReversedSuffix(domain.GetReversed(), [this, &forbidden](string_view suffix) {
+                forbidden = Contains(suffix);
+                return forbidden;
+            });
+            return forbidden;
+        }
+
+        bool Contains(string_view reversed) const {
+            return added_.Contains(reversed)
+                || (snapshot_->Contains(reversed) && !removed_.Contains(reversed));
+        }
+
+        size_t Size() const {
+            return snapshot_->Size() + added_.Size() - removed_.Size();
+        }
+
+        // Сколько изменений накопилось в дельте после снимка.
+        size_t DeltaSize() const {
+            return added_.Size() + removed_.Size();
+        }
+
+        // Вызывает f(reversed) для каждого запрещённого домена в порядке ReversedLess,
+        // сливая ключи снимка с добавленными доменами.
+        template <typename Func>
+        void ForEach(Func f) const {
+            vector<string> added;
+            added_.ForEach([&added](string_view reversed) {
+                added.emplace_back(reversed);
+            });
+            size_t j = 0;
+            for (size_t i = 0; i < snapshot_->Size(); ++i) {
+                const string_view key = snapshot_->GetReversed(i);
+                for (; j < added.size() && ReversedLess(added[j], key); ++j) {
+                    f(string_view(added[j]));
+                }
+                if (!removed_.Contains(key)) {
+                    f(key);
+                }
+            }
+            for (; j < added.size(); ++j) {
+                f(string_view(added[j]));
+            }
+        }
+
+    private:
+        friend class DurableDomainIndex;
+
+        explicit View(shared_ptr<const CompiledDomainIndex> snapshot)
+            : snapshot_(move(snapshot)) {}
+
+        // Дельта хранит только отличия от снимка: added_ не пересекается со снимком,
+        // а removed_ — его подмножество.
+        View Insert(const Domain& domain) const {
+            View result = *this;
+            if (snapshot_->Contains(domain.GetReversed())) {
+                result.removed_ = removed_.Erase(domain);
+            } else {
+                result.added_ = added_.Insert(domain);
+            }
+            return result;
+        }
+
+        View Erase(const Domain& domain) const {
+            View result = *this;
+            if (snapshot_->Contains(domain.GetReversed())) {
+                result.removed_ = removed_.Insert(domain);
+            } else {
+                result.added_ = added_.Erase(domain);
+            }
+            return result;
+        }
+
+        View Apply(const LogRecord& record) const {
+            const Domain domain(record.domain);
+            return record.add ? Insert(domain) : Erase(domain);
+        }
+
+        shared_ptr<const CompiledDomainIndex> snapshot_;
+        PersistentDomainTrie added_;
+        PersistentDomainTrie removed_;
+    };
+
+    DurableDomainIndex(string snapshot_path, string log_path)
+        : snapshot_path_(move(snapshot_path))
+        , log_path_(move(log_path))
+        , current_(OpenSnapshot(snapshot_path_)) {
+        // Недописанная при сбое последняя строка не доигрывается и обрезается,
+        // чтобы следующая запись не склеилась с ней.
+        string log;
+        if (ifstream input(log_path_, ios::binary); input) {
+            ostringstream bytes;
+            bytes << input.rdbuf();
+            log = move(bytes).str();
+        }
+        const size_t complete = log.rfind('\n') + 1;
+        istringstream records(log.substr(0, complete));
+        replayed_records_ = ReadLogRecords(records, [this](const LogRecord& record) {
+            current_ = current_.Apply(record);
+        });
+
+        log_fd_ = open(log_path_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log_fd_ < 0) {
+            throw runtime_error("cannot open "s + log_path_ + ": " + strerror(errno));
+        }
+        if (complete < log.size() && ftruncate(log_fd_, static_cast<off_t>(complete)) != 0) {
+            const int error = errno;
+            close(log_fd_);
+            throw runtime_error("cannot truncate "s + log_path_ + ": " + strerror(error));
+        }
+        log_size_ = complete;
+    }
+
+    DurableDomainIndex(const DurableDomainIndex&) = delete;
+    DurableDomainIndex& operator=(const DurableDomainIndex&) = delete;
+
+    ~DurableDomainIndex() {
+        close(log_fd_);
+    }
+
+    void Add(const Domain& domain) {
+        lock_guard lock(mutex_);
+        AppendToLog(LogRecord{true, domain.ToString()});
+        Publish(current_.Insert(domain));
+    }
+
+    void Remove(const Domain& domain) {
+        lock_guard lock(mutex_);
+        AppendToLog(LogRecord{false, domain.ToString()});
+        Publish(current_.Erase(domain));
+    }
+
+    // Применяет дельту (например, из файла DiffSortedReversed) одной записью в журнал
+    // с одним fdatasync; читатели видят её целиком или не видят вовсе.
+    void Apply(const vector<LogRecord>& records) {
+        lock_guard lock(mutex_);
+        ostringstream lines;
+        for (const LogRecord& record : records) {
+            WriteLogRecord(lines, record);
+        }
+        AppendToLog(lines.str());
+        View next = current_;
+        for (const LogRecord& record : records) {
+            next = next.Apply(record);
+        }
+        Publish(move(next));
+    }
+
+    // Журнал обрезается только после того, как новый снимок переименован на место:
+    // если упасть между этими шагами, повторное доигрывание записей ничего не меняет.
+    void Checkpoint() {
+        lock_guard lock(mutex_);
+        vector<string> keys;
+        keys.reserve(current_.Size());
+        current_.ForEach([&keys](string_view reversed) {
+            keys.emplace_back(reversed);
+        });
+        WriteFileAtomically(snapshot_path_, CompiledDomainIndex::Build(keys));
+        View next(OpenSnapshot(snapshot_path_));
+        if (ftruncate(log_fd_, 0) != 0) {
+            throw runtime_error("cannot truncate "s + log_path_ + ": " + strerror(errno));
+        }
+        log_size_ = 0;
+        Publish(move(next));
+    }
+
+    View Snapshot() const {
+        lock_guard lock(view_mutex_);
+        return current_;
+    }
+
+    bool IsForbidden(const Domain& domain) const {
+        return Snapshot().IsForbidden(domain);
+    }
+
+    // Сколько записей журнала пришлось доиграть при открытии.
+    size_t ReplayedRecords() const {
+        return replayed_records_;
+    }
+
+private:
+    static shared_ptr<const CompiledDomainIndex> OpenSnapshot(const string& path) {
+        if (access(path.c_str(), F_OK) != 0) {
+            return make_shared<const CompiledDomainIndex>(CompiledDomainIndex::FromBytes(CompiledDomainIndex::Build({})));
+        }
+        return make_shared<const CompiledDomainIndex>(CompiledDomainIndex::Open(path));
+    }
+
+    // current_ меняет только писатель под mutex_, поэтому сам он читает его без view_mutex_.
+    void Publish(View next) {
+        lock_guard lock(view_mutex_);
+        current_ = move(next);
+    }
+
+    void AppendToLog(const LogRecord& record) {
+        ostringstream line;
+        WriteLogRecord(line, record);
+        AppendToLog(line.str());
+    }
+
+    // Если запись не удалась целиком, журнал обрезается до прежнего размера,
+    // чтобы в нём не осталось половины строки или изменения, не попавшего в память.
+    void AppendToLog(const string& bytes) {
+        size_t written = 0;
+        while (written < bytes.size()) {
+            const ssize_t n = write(log_fd_, bytes.data() + written, bytes.size() - written);
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n <= 0) { break; }
+            written += static_cast<size_t>(n);
+        }
+        if (written == bytes.size() && fdatasync(log_fd_) == 0) {
+            log_size_ += written;
+            return;
+        }
+        const int error = errno;
+        // Если не выйдет и обрезать, недописанную строку отбросит следующее открытие.
+        const int truncated = ftruncate(log_fd_, static_cast<off_t>(log_size_));
+        (void)truncated;
+        throw runtime_error("cannot append to "s + log_path_ + ": " + strerror(error));
+    }
+
+    string snapshot_path_;
+    string log_path_;
+    mutex mutex_;
+    mutable mutex view_mutex_;
+    View current_;
+    int log_fd_ = -1;
+    size_t log_size_ = 0;
+    size_t replayed_records_ = 0;
+};
+
+// Ищет домены, похожие на защищённые бренды (тайпсквоттинг).
+// Сравнивается регистрируемая метка — вторая от конца ("gdz" в "math.gdz.ru"),
+// списка публичных суффиксов здесь нет. Домен считается подделкой, если расстояние
+// Левенштейна между метками не больше порога, а регистрируемые домены различаются
+// (так ловится и "gdz.com" при бренде "gdz.ru").
+// Поиск — хеширование окрестностей удалений: для бренда заранее сохраняются хеши всех
+// вариантов с удалением до k символов; у двух строк на расстоянии ≤ k обязательно есть
+// общий такой вариант. На запрос перебираются его удаления — O(n²) поисков в хеш-таблице
+// без выделения памяти (около 2000 для метки из 63 символов), а кандидаты проверяются
+// точным расстоянием. Метки, длина которых дальше порога от длин всех брендов,
+// отбрасываются сразу, без перебора.
+class TyposquatDetector {
+public:
+    static constexpr size_t MAX_DISTANCE = 2;
+    static constexpr size_t MAX_LABEL = 63;
+
+    template <typename Iterator>
+    TyposquatDetector(Iterator begin, Iterator end) {
+        for (; begin != end; ++begin) {
+            const string_view registrable = RegistrableReversed(begin->GetReversed());
+            const string_view label = LastLabel(registrable);
+            if (label.empty() || label.size() > MAX_LABEL) { continue; }
+            const uint32_t id = static_cast<uint32_t>(brands_.size());
+            brands_.push_back(Brand{string(registrable), string(label), begin->ToString()});
+            brand_lengths_ |= uint64_t{1} << label.size();
+            ForEachDeletion(label, MaxDistance(label.size()), [&](uint64_t hash) {
+                vector<uint32_t>& ids = index_[hash];
+                if (ids.empty() || ids.back() != id) {
+                    ids.push_back(id);
+                }
+            });
+        }
+    }
+
+    // Возвращает бренд, на который похож домен, или nullopt.
+    optional<string_view> FindLookalike(const Domain& domain) const {
+        const string_view registrable = RegistrableReversed(domain.GetReversed());
+        const string_view label = LastLabel(registrable);
+        if (label.empty() || label.size() > MAX_LABEL) { return nullopt; }
+        const size_t k = MaxDistance(label.size());
+        const size_t shortest = label.size() > k ? label.size() - k : 0;
+        if ((brand_lengths_ & LengthsBetween(shortest, min(label.size() + k, MAX_LABEL))) == 0) { return nullopt; }
+
+        optional<string_view> found;
+        ForEachDeletion(label, k, [&](uint64_t hash) {
+            if (found) { return; }
+            const auto it = index_.find(hash);
+            if (it == index_.end()) { return; }
+            for (uint32_t id : it->second) {
+                const Brand& brand = brands_[id];
+                if (brand.registrable != registrable
+                    && EditDistance(label, brand.label) <= min(k, MaxDistance(brand.label.size()))) {
+                    found = brand.name;
+                    return;
+                }
+            }
+        });
+        return found;
+    }
+
+private:
+    struct Brand {
+        string registrable;
+        string label;
+        string name;
+    };
+
+    // На коротких метках расстояние 2 совпадает почти с чем угодно, поэтому порог растёт с длиной.
+    static size_t MaxDistance(size_t length) {
+        return length >= 6 ? MAX_DISTANCE : length >= 3 ? 1 : 0;
+    }
+
+    // "ru.gdz.math" → "ru.gdz"; для домена из одной метки — пустая строка.
+    static string_view RegistrableReversed(string_view rev) {
+        const size_t first = rev.find('.');
+        if (first == string_view::npos) { return {}; }
+        return rev.substr(0, rev.find('.', first + 1));
+    }
+
+    static string_view LastLabel(string_view rev) {
+        return rev.substr(rev.rfind('.') + 1);
+    }
+
+    // Маска длин from..to включительно (to ≤ MAX_LABEL = 63, поэтому хватает 64 бит).
+    static uint64_t LengthsBetween(size_t from, size_t to) {
+        return (~uint64_t{0} >> (63 - to)) & (~uint64_t{0} << from);
+    }
+
+    // Перебирает хеши строки с удалёнными не более чем k символами (k ≤ 2), включая саму строку.
+    // Хеш полиномиальный: h(ab) = h(a) * BASE^|b| + h(b), поэтому хеш каждого варианта
+    // собирается из префиксных хешей за O(1), без копирования строки.
+    template <typename Func>
+    static void ForEachDeletion(string_view label, size_t k, Func f) {
+        constexpr uint64_t BASE = 1099511628211ull;
+        const size_t n = label.size();
+        uint64_t prefix[MAX_LABEL + 1];
+        uint64_t power[MAX_LABEL + 1];
+        prefix[0] = 0;
+        power[0] = 1;
+        for (size_t p = 0; p < n; ++p) {
+            prefix[p + 1] = prefix[p] * BASE + static_cast<unsigned char>(label[p]) + 1;
+            power[p + 1] = power[p] * BASE;
+        }
+        // Хеш подстроки [from, to).
+        const auto range = [&](size_t from, size_t to) {
+            return prefix[to] - prefix[from] * power[to - from];
+        };
+        f(prefix[n]);
+        for (size_t i = 0; k >= 1 && i < n; ++i) {
+            f(prefix[i] * power[n - i - 1] + range(i + 1, n));
+            for (size_t j = i + 1; k >= 2 && j < n; ++j) {
+                f((prefix[i] * power[j - i - 1] + range(i + 1, j)) * power[n - j - 1] + range(j + 1, n));
+            }
+        }
+    }
+
+    static size_t EditDistance(string_view a, string_view b) {
+        size_t row[MAX_LABEL + 1];
+        for (size_t j = 0; j <= b.size(); ++j) {
+            row[j] = j;
+        }
+        for (size_t i = 1; i <= a.size(); ++i) {
+            size_t diagonal = row[0];
+            row[0] = i;
+            for (size_t j = 1; j <= b.size(); ++j) {
+                const size_t up = row[j];
+                row[j] = min({up + 1, row[j - 1] + 1, diagonal + (a[i - 1] == b[j - 1] ? 0 : 1)});
+                diagonal = up;
+            }
+        }
+        return row[b.size()];
+    }
+
+    vector<Brand> brands_;
+    uint64_t brand_lengths_ = 0;  // бит L — есть бренд с меткой длины L
+    unordered_map<uint64_t, vector<uint32_t>> index_;
+};
+
+// Оценивает, похожа ли левая метка домена на сгенерированную алгоритмом (DGA).
+// Признаки: энтропия символов, средняя «неправдоподобность» биграмм по модели,
+// обученной на встроенном словаре, длина самой длинной серии согласных и доля цифр.
+// Все признаки считаются за один проход по метке через таблицы поиска, без ветвлений
+// по символам и без выделения памяти; короткие метки не оцениваются.
+class DgaScorer {
+public:
+    static constexpr size_t MIN_LABEL = 8;
+    static constexpr size_t MAX_LABEL = 63;
+    static constexpr double DEFAULT_THRESHOLD = 2.5;
+
+    explicit DgaScorer(double threshold = DEFAULT_THRESHOLD)
+        : threshold_(threshold) {
+        for (int c = 0; c < 256; ++c) {
+            const int lower = tolower(c);
+            const bool letter = lower >= 'a' && lower <= 'z';
+            const bool digit = c >= '0' && c <= '9';
+            letter_[c] = letter ? static_cast<uint8_t>(lower - 'a') : OTHER;
+            symbol_[c] = letter ? letter_[c] : digit ? static_cast<uint8_t>(26 + c - '0') : 36;
+            consonant_[c] = letter && !strchr("aeiouy", lower);
+            digit_[c] = digit;
+        }
+        for (size_t count = 1; count <= MAX_LABEL; ++count) {
+            x_log_x_[count] = count * log2(static_cast<double>(count));
+        }
+        TrainBigrams();
+    }
+
+    // Чем больше, тем менее метка похожа на слова естественного языка.
+    double Score(const Domain& domain) const {
+        const string& rev = domain.GetReversed();
+        string_view label = string_view(rev).substr(rev.rfind('.') + 1);
+        if (label.size() < MIN_LABEL) { return 0.0; }
+        label = label.substr(0, MAX_LABEL);
+
+        uint8_t histogram[37] = {};
+        double bigram = 0.0;
+        size_t run = 0;
+        size_t max_run = 0;
+        size_t digits = 0;
+        uint8_t prev = OTHER;
+        for (const char ch : label) {
+            const auto c = static_cast<unsigned char>(ch);
+            ++histogram[symbol_[c]];
+            bigram += bigram_cost_[prev][letter_[c]];
+            prev = letter_[c];
+            run = (run + 1) * consonant_[c];
+            max_run = max(max_run, run);
+            digits += digit_[c];
+        }
+        bigram += bigram_cost_[prev][OTHER];
+
+        const double n = static_cast<double>(label.size());
+        double sum = 0.0;
+        for (const uint8_t count : histogram) {
+            sum += x_log_x_[count];
+        }
+        const double entropy = log2(n) - sum / n;
+        const double mean_bigram = bigram / (n + 1);
+
+        return 1.5 * (mean_bigram - 4.0)
+            + 0.4 * (max_run > 3 ? max_run - 3 : 0)
+            + 3.0 * (digits / n)
+            + 0.5 * (entropy - 2.5);
+    }
+
+    bool IsSuspicious(const Domain& domain) const {
+        return Score(domain) >= threshold_;
+    }
+
+private:
+    static constexpr uint8_t OTHER = 26;
+
+    // Небольшой словарь частых слов и частей доменов для модели биграмм
+    // (начало и конец слова считаются символом OTHER, сглаживание add-one).
+    void TrainBigrams() {
+        static constexpr string_view CORPUS =
+            "the and for that with this from your have more about news home page search free time only "
+            "site will here info service world online shop store market mail login account secure bank "
+            "best post music video games sport travel hotel book books health life people city school "
+            "group media cloud data tech software system network mobile phone apps learn study education "
+            "center today daily weekly story stories photo image images design studio office work jobs "
+            "career money finance credit card insurance estate house garden food recipe kitchen coffee "
+            "beauty fashion style women men kids baby family friend friends love dating chat forum blog "
+            "wiki help support docs download files share social club team player football hockey tennis "
+            "weather maps translate google yandex facebook twitter amazon apple microsoft wikipedia "
+            "youtube github stackoverflow instagram linkedin reddit netflix yahoo windows update static "
+            "content delivery server client portal gateway analytics tracking metrics events api cdn "
+            "assets storage backup private public global national local international company business "
+            "solutions services consulting marketing digital agency creative planet space star light "
+            "green blue red black white north south east west river mountain ocean lake forest"sv;
+        uint32_t counts[27][27] = {};
+        uint8_t prev = OTHER;
+        for (const char ch : CORPUS) {
+            const uint8_t cur = letter_[static_cast<unsigned char>(ch)];
+            ++counts[prev][cur];
+            prev = cur;
+        }
+        ++counts[prev][OTHER];
+        for (size_t a = 0; a < 27; ++a) {
+            double total = 0.0;
+            for (size_t b = 0; b < 27; ++b) {
+                total += counts[a][b] + 1;
+            }
+            for (size_t b = 0; b < 27; ++b) {
+                bigram_cost_[a][b] = -log2((counts[a][b] + 1) / total);
+            }
+        }
+    }
+
+    double threshold_;
+    uint8_t letter_[256];
+    uint8_t symbol_[256];
+    uint8_t consonant_[256];
+    uint8_t digit_[256];
+    double x_log_x_[MAX_LABEL + 1] = {};
+    double bigram_cost_[27][27];
+};
+
+// Запись о сработавшем правиле для асинхронного журнала.
+struct MatchRecord {
+    uint64_t domain_handle = 0;  // непрозрачный номер запроса, выбирает вызывающий
+    uint32_t rule_id = 0;
+    int64_t timestamp_ns = 0;    // system_clock, наносекунды от эпохи
+};
+
+// Кольцевой буфер на одного писателя и одного читателя без блокировок.
+// Ёмкость округляется до степени двойки; при переполнении запись отбрасывается.
+class MatchRing {
+public:
+    explicit MatchRing(size_t capacity)
+        : buffer_(RoundUpToPowerOfTwo(capacity))
+        , mask_(buffer_.size() - 1) {}
+
+    // Вызывается только потоком-владельцем.
+    bool TryPush(const MatchRecord& record) {
+        const size_t tail = tail_.load(memory_order_relaxed);
+        if (tail - head_.load(memory_order_acquire) == buffer_.size()) {
+            dropped_.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        buffer_[tail & mask_] = record;
+        tail_.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+    // Вызывается только фоновым писателем. Возвращает число вычитанных записей.
+    template <typename Func>
+    size_t Drain(Func f) {
+        const size_t head = head_.load(memory_order_relaxed);
+        const size_t tail = tail_.load(memory_order_acquire);
+        for (size_t i = head; i != tail; ++i) {
+            f(buffer_[i & mask_]);
+        }
+        head_.store(tail, memory_order_release);
+        return tail - head;
+    }
+
+    uint64_t Dropped() const {
+        return dropped_.load(memory_order_relaxed);
+    }
+
+private:
+    static size_t RoundUpToPowerOfTwo(size_t value) {
+        size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    vector<MatchRecord> buffer_;
+    size_t mask_;
+    // Разнесены по разным кэш-линиям, чтобы писатель и читатель не мешали друг другу.
+    alignas(64) atomic<size_t> head_{0};
+    alignas(64) atomic<size_t> tail_{0};
+    alignas(64) atomic<uint64_t> dropped_{0};
+};
+
+// Асинхронный журнал заблокированных запросов.
+// Каждый поток пишет в свой MatchRing без блокировок и системных вызовов; фоновый поток
+// собирает записи из всех буферов и пишет их в output пачками строк
+// "timestamp_ns\trule_id\tdomain_handle". Если буфер полон, запись отбрасывается и
+// учитывается в Dropped() — проверка никогда не ждёт диск.
+class AsyncMatchLogger {
+public:
+    explicit AsyncMatchLogger(ostream& output, size_t ring_capacity = 1 << 16)
+        : output_(output)
+        , ring_capacity_(ring_capacity)
+        , id_(next_id_.fetch_add(1))
+        , writer_([this] { WriterLoop(); }) {}
+
+    AsyncMatchLogger(const AsyncMatchLogger&) = delete;
+    AsyncMatchLogger& operator=(const AsyncMatchLogger&) = delete;
+
+    // Дописывает всё накопленное и останавливает фоновый поток.
+    // К этому моменту потоки, вызывающие Log, должны закончить работу.
+    ~AsyncMatchLogger() {
+        stop_.store(true, memory_order_release);
+        writer_.join();
+    }
+
+    void Log(uint64_t domain_handle, uint32_t rule_id) {
+        const auto now = chrono::system_clock::now().time_since_epoch();
+        LocalRing().TryPush(MatchRecord{domain_handle, rule_id,
+                                        chrono::duration_cast<chrono::nanoseconds>(now).count()});
+    }
+
+    uint64_t Dropped() const {
+        lock_guard lock(rings_mutex_);
+        uint64_t dropped = 0;
+        for (const RingSlot& slot : rings_) {
+            dropped += slot.ring->Dropped();
+        }
+        return dropped;
+    }
+
+    // Число буферов: по одному на каждый поток, писавший в журнал.
+    size_t RingCount() const {
+        lock_guard lock(rings_mutex_);
+        return rings_.size();
+    }
+
+private:
+    // Буфер текущего потока заводится при первом вызове; потом берётся из thread_local кэша.
+    // Кэш держит буферы нескольких журналов, записи помечены id журнала, чтобы не перепутать
+    // его с журналом, созданным на том же адресе. При промахе буфер потока ищется в rings_,
+    // поэтому поток, чередующий больше журналов, чем помещается в кэш, не заводит новых буферов.
+    MatchRing& LocalRing() {
+        struct CacheEntry {
+            uint64_t logger_id = 0;
+            MatchRing* ring = nullptr;
+        };
+        thread_local array<CacheEntry, LOCAL_CACHE_SIZE> cache;
+        thread_local size_t next_victim = 0;
+        for (const CacheEntry& entry : cache) {
+            if (entry.logger_id == id_) { return *entry.ring; }
+        }
+        MatchRing* ring = nullptr;
+        {
+            lock_guard lock(rings_mutex_);
+            const thread::id self = this_thread::get_id();
+            for (const RingSlot& slot : rings_) {
+                if (slot.owner == self) {
+                    ring = slot.ring.get();
+                    break;
+                }
+            }
+            if (ring == nullptr) {
+                rings_.push_back(RingSlot{self, make_unique<MatchRing>(ring_capacity_)});
+                ring = rings_.back().ring.get();
+            }
+        }
+        cache[next_victim] = CacheEntry{id_, ring};
+        next_victim = (next_victim + 1) % cache.size();
+        return *ring;
+    }
+
+    void WriterLoop() {
+        string batch;
+        vector<MatchRing*> rings;
+        while (true) {
+            const bool stopping = stop_.load(memory_order_acquire);
+            {
+                lock_guard lock(rings_mutex_);
+                rings.clear();
+                for (const RingSlot& slot : rings_) {
+                    rings.push_back(slot.ring.get());
+                }
+            }
+            size_t drained = 0;
+            for (MatchRing* ring : rings) {
+                drained += ring->Drain([&batch](const MatchRecord& record) {
+                    batch += to_string(record.timestamp_ns);
+                    batch += '\t';
+                    batch += to_string(record.rule_id);
+                    batch += '\t';
+                    batch += to_string(record.domain_handle);
+                    batch += '\n';
+                });
+            }
+            if (!batch.empty() && (batch.size() >= FLUSH_BYTES || drained == 0 || stopping)) {
+                output_.write(batch.data(), static_cast<streamsize>(batch.size()));
+                output_.flush();
+                batch.clear();
+            }
+            if (stopping) { break; }
+            if (drained == 0) {
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+        }
+    }
+
+    static constexpr size_t FLUSH_BYTES = 1 << 16;
+    static constexpr size_t LOCAL_CACHE_SIZE = 4;
+    static inline atomic<uint64_t> next_id_{1};
+
+    struct RingSlot {
+        thread::id owner;
+        unique_ptr<MatchRing> ring;
+    };
+
+    ostream& output_;
+    size_t ring_capacity_;
+    uint64_t id_;
+    mutable mutex rings_mutex_;
+    vector<RingSlot> rings_;
+    atomic<bool> stop_{false};
+    thread writer_;
+};
+
+enum class Verdict {
+    GOOD,
+    BAD,
+    SUSPICIOUS,
+    INVALID,  // строка не является именем хоста, см. HostnameError
+};
+
+inline string_view VerdictName(Verdict verdict) {
+    switch (verdict) {
+    case Verdict::GOOD:
+        return "Good"sv;
+    case Verdict::BAD:
+        return "Bad"sv;
+    case Verdict::SUSPICIOUS:
+        return "Suspicious"sv;
+    case Verdict::INVALID:
+        return "Invalid"sv;
+    }
+    return {};
+}
+
+// Экранирует text для строки JSON: кавычку и обратную косую черту — через '\\',
+// управляющие символы — как \u00XX. put(char) получает выходные символы по одному.
+template <typename Put>
+void EscapeJson(string_view text, Put put) {
+    static constexpr char HEX[] = "0123456789abcdef";
+    for (const char c : text) {
+        const auto u = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            put('\\');
+            put(c);
+        } else if (u < 0x20) {
+            for (const char e : { '\\', 'u', '0', '0', HEX[u >> 4], HEX[u & 0xF] }) {
+                put(e);
+            }
+        } else {
+            put(c);
+        }
+    }
+}
+
+enum class OutputFormat {
+    PLAIN,  // только вердикт: "Bad" / "Good"
+    JSONL,  // {"domain":...,"verdict":...,"rule":...,"category":...} на строку
+    TSV,    // домен, вердикт, правило, категория через табуляцию
+};
+
+// Пишет результаты проверки в выходной буфер фиксированного размера.
+// Форматирование ручное и не выделяет память: домен выводится в исходной записи прямо
+// из обращённой (метки в обратном порядке), числа и экранирование — посимвольно.
+// Буфер сбрасывается в поток, когда заполняется, и в деструкторе.
+class ResultWriter {
+public:
+    ResultWriter(ostream& output, OutputFormat format)
+        : output_(output)
+        , format_(format) {}
+
+    ResultWriter(const ResultWriter&) = delete;
+    ResultWriter& operator=(const ResultWriter&) = delete;
+
+    ~ResultWriter() {
+        Flush();
+    }
+
+    // rule и category могут быть пустыми (в JSON тогда пишется null).
+    void Write(const Domain& domain, Verdict verdict, string_view rule, string_view category) {
+        switch (format_) {
+        case OutputFormat::PLAIN:
+            Append(VerdictName(verdict));
+            break;
+        case OutputFormat::JSONL:
+            Append("{\"domain\":\""sv);
+            AppendDomain(domain);
+            Append("\",\"verdict\":\""sv);
+            Append(VerdictName(verdict));
+            Append("\",\"rule\":"sv);
+            AppendJsonValue(rule);
+            Append(",\"category\":"sv);
+            AppendJsonValue(category);
+            Put('}');
+            break;
+        case OutputFormat::TSV:
+            AppendDomain(domain);
+            Put('\t');
+            Append(VerdictName(verdict));
+            Put('\t');
+            AppendEscaped(rule);
+            Put('\t');
+            AppendEscaped(category);
+            break;
+        }
+        Put('\n');
+    }
+
+    void Flush() {
+        WriteOut(string_view(buffer_.data(), size_));
+        size_ = 0;
+    }
+
+    // Сколько байт отдано в поток и сколько секунд заняла запись в него (для --timing).
+    // Замер идёт только при сбросе буфера, то есть раз на 64 КиБ вывода.
+    uint64_t BytesWritten() const {
+        return bytes_written_;
+    }
+
+    double WriteSeconds() const {
+        return write_seconds_;
+    }
+
+private:
+    void WriteOut(string_view data) {
+        const auto start = chrono::steady_clock::now();
+        output_.write(data.data(), static_cast<streamsize>(data.size()));
+        output_.flush();
+        write_seconds_ += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bytes_written_ += data.size();
+    }
+
+    void Put(char c) {
+        if (size_ == buffer_.size()) {
+            Flush();
+        }
+        buffer_[size_++] = c;
+    }
+
+    void Append(string_view text) {
+        if (text.size() > buffer_.size() - size_) {
+            Flush();
+            if (text.size() > buffer_.size()) {
+                WriteOut(text);
+                return;
+            }
+        }
+        memcpy(buffer_.data() + size_, text.data(), text.size());
+        size_ += text.size();
+    }
+
+    // Экранирует под формат: в JSON — кавычки, обратную косую черту и управляющие символы,
+    // в TSV — табуляцию, переводы строк и обратную косую черту.
+    void AppendEscaped(string_view text) {
+        if (format_ == OutputFormat::JSONL) {
+            EscapeJson(text, [this](char c) { Put(c); });
+            return;
+        }
+        for (const char c : text) {
+            if (c == '\\') {
+                Put('\\');
+                Put(c);
+            } else if (format_ == OutputFormat::TSV && (c == '\t' || c == '\n' || c == '\r')) {
+                Put('\\');
+                Put(c == '\t' ? 't' : c == '\n' ? 'n' : 'r');
+            } else {
+                Put(c);
+            }
+        }
+    }
+
+    void AppendJsonValue(string_view text) {
+        if (text.empty()) {
+            Append("null"sv);
+            return;
+        }
+        Put('"');
+        AppendEscaped(text);
+        Put('"');
+    }
+
+    // "ru.gdz.math" → "math.gdz.ru" без промежуточной строки.
+    void AppendDomain(const Domain& domain) {
+        const string_view rev = domain.GetReversed();
+        if (domain.GetIp()) {
+            AppendEscaped(rev);
+            return;
+        }
+        size_t end = rev.size();
+        while (true) {
+            const size_t dot = rev.rfind('.', end == 0 ? 0 : end - 1);
+            const size_t begin = (dot == string_view::npos || end == 0) ? 0 : dot + 1;
+            AppendEscaped(rev.substr(begin, end - begin));
+            if (begin == 0) { break; }
+            Put('.');
+            end = dot;
+        }
+    }
+
+    ostream& output_;
+    OutputFormat format_;
+    array<char, 1 << 16> buffer_;
+    size_t size_ = 0;
+    uint64_t bytes_written_ = 0;
+    double write_seconds_ = 0;
+};
+
+// Протокол сервера на Unix-сокете.
+// Запрос — кадр: длина полезной нагрузки (uint32, little-endian) и домены через '\n'.
+// Ответ — кадр той же структуры: по одному байту на домен, 'B' (Bad), 'G' (Good)
+// или 'I' (Invalid — строка не является именем хоста).
+// Клиент может слать кадры подряд, не дожидаясь ответов (конвейер); ответы идут в том же порядке.
+namespace frame_protocol {
+
+constexpr size_t HEADER_SIZE = 4;
+constexpr size_t MAX_PAYLOAD = 16 << 20;
+
+inline void AppendHeader(string& output, size_t payload_size) {
+    for (size_t i = 0; i < HEADER_SIZE; ++i) {
+        output += static_cast<char>((payload_size >> (8 * i)) & 0xFF);
+    }
+}
+
+// Обрабатывает все полные кадры из начала input, дописывая ответы в output,
+// и удаляет их из input. Незаконченный кадр остаётся ждать следующих данных.
+// Возвращает false, если кадр превышает MAX_PAYLOAD — соединение нужно закрыть.
+inline bool ProcessFrames(string& input, string& output, const DomainChecker& checker) {
+    // Буферы живут в потоке, чтобы поток запросов обслуживался без выделений памяти.
+    thread_local string line;
+    thread_local Domain domain = Domain::FromReversed({});
+    size_t pos = 0;
+    while (input.size() - pos >= HEADER_SIZE) {
+        size_t length = 0;
+        for (size_t i = 0; i < HEADER_SIZE; ++i) {
+            length |= size_t{static_cast<unsigned char>(input[pos + i])} << (8 * i);
+        }
+        if (length > MAX_PAYLOAD) {
+            return false;
+        }
+        if (input.size() - pos - HEADER_SIZE < length) {
+            break;
+        }
+        string_view payload = string_view(input).substr(pos + HEADER_SIZE, length);
+        const size_t answers_at = output.size();
+        AppendHeader(output, 0);
+        size_t answers = 0;
+        size_t matches = 0;
+        TRACE_POINT1(batch__begin, 0);
+        while (!payload.empty()) {
+            const size_t newline = payload.find('\n');
+            line.assign(payload.substr(0, newline));
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            domain.Assign(line);
+            const bool forbidden = domain.IsValid() && checker.IsForbidden(domain);
+            output += !domain.IsValid() ? 'I' : forbidden ? 'B' : 'G';
+            matches += forbidden;
+            ++answers;
+            payload.remove_prefix(newline == string_view::npos ? payload.size() : newline + 1);
+        }
+        TRACE_POINT2(batch__end, answers, matches);
+        for (size_t i = 0; i < HEADER_SIZE; ++i) {
+            output[answers_at + i] = static_cast<char>((answers >> (8 * i)) & 0xFF);
+        }
+        pos += HEADER_SIZE + length;
+    }
+    input.erase(0, pos);
+    return true;
+}
+
+} // namespace frame_protocol
+
+// HTTP/1.1 поверх того же сервера: GET /check?domain=... и пакетный POST /check
+// (домены через '\n' в теле). Ответ — JSON. Соединения по умолчанию keep-alive.
+// Разбор идёт по string_view прямо во входном буфере соединения, без копирования запроса.
+namespace http_protocol {
+
+constexpr size_t MAX_HEADER = 16 << 10;
+constexpr size_t MAX_BODY = 16 << 20;
+
+inline bool EqualsIgnoreCase(string_view lhs, string_view rhs) {
+    return lhs.size() == rhs.size() && equal(lhs.begin(), lhs.end(), rhs.begin(), [](char a, char b) {
+        return tolower(static_cast<unsigned char>(a)) == tolower(static_cast<unsigned char>(b));
+    });
+}
+
+inline string_view Trim(string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) { text.remove_prefix(1); }
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) { text.remove_suffix(1); }
+    return text;
+}
+
+inline void AppendJsonString(string& output, string_view text) {
+    output += '"';
+    EscapeJson(text, [&output](char c) { output += c; });
+    output += '"';
+}
+
+// Ищет параметр key в строке запроса (после '?') и возвращает его ещё не декодированное
+// значение. Ключи сравниваются целиком, поэтому "subdomain=" не найдётся как "domain".
+inline optional<string_view> FindQueryParam(string_view params, string_view key) {
+    while (!params.empty()) {
+        const size_t end = params.find('&');
+        const string_view param = params.substr(0, end);
+        params.remove_prefix(end == string_view::npos ? params.size() : end + 1);
+        const size_t equals = param.find('=');
+        if (param.substr(0, equals) == key) {
+            return equals == string_view::npos ? string_view{} : param.substr(equals + 1);
+        }
+    }
+    return nullopt;
+}
+
+// Декодирует %XX и '+' из параметра запроса.
+inline void DecodeQueryValue(string_view value, string& output) {
+    output.clear();
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '%' && i + 2 < value.size() && isxdigit(static_cast<unsigned char>(value[i + 1]))
+            && isxdigit(static_cast<unsigned char>(value[i + 2]))) {
+            output += static_cast<char>(stoi(string(value.substr(i + 1, 2)), nullptr, 16));
+            i += 2;
+        } else {
+            output += value[i] == '+' ? ' ' : value[i];
+        }
+    }
+}
+
+// Возвращает true, если домен запрещён.
+inline bool AppendResult(string& body, const string& domain, const DomainChecker& checker) {
+    body += "{\"domain\":";
+    AppendJsonString(body, domain);
+    body += ",\"verdict\":\"";
+    thread_local Domain parsed = Domain::FromReversed({});
+    parsed.Assign(domain);
+    const bool forbidden = parsed.IsValid() && checker.IsForbidden(parsed);
+    body += VerdictName(!parsed.IsValid() ? Verdict::INVALID : forbidden ? Verdict::BAD : Verdict::GOOD);
+    body += "\"}";
+    return forbidden;
+}
+
+inline void AppendResponse(string& output, string_view status, string_view body, bool keep_alive) {
+    output += "HTTP/1.1 ";
+    output += status;
+    output += "\r\nContent-Type: application/json\r\nContent-Length: ";
+    output += to_string(body.size());
+    output += keep_alive ? "\r\n\r\n"sv : "\r\nConnection: close\r\n\r\n"sv;
+    output += body;
+}
+
+// Обрабатывает все полные запросы из начала input. Возвращает false, если соединение
+// нужно закрыть: клиент попросил Connection: close или прислал некорректный запрос.
+inline bool ProcessRequests(string& input, string& output, const DomainChecker& checker) {
+    // Буферы живут в потоке, чтобы поток запросов обслуживался без выделений памяти.
+    thread_local string body;
+    thread_local string domain;
+    size_t pos = 0;
+    bool keep_alive = true;
+    while (keep_alive) {
+        const string_view rest = string_view(input).substr(pos);
+        const size_t header_end = rest.find("\r\n\r\n"sv);
+        if (header_end == string_view::npos) {
+            if (rest.size() > MAX_HEADER) { keep_alive = false; }
+            break;
+        }
+        string_view header = rest.substr(0, header_end);
+        const size_t line_end = header.find("\r\n"sv);
+        const string_view request_line = header.substr(0, line_end);
+        header.remove_prefix(line_end == string_view::npos ? header.size() : line_end + 2);
+
+        const size_t method_end = request_line.find(' ');
+        const size_t target_end = request_line.rfind(' ');
+        if (method_end == string_view::npos || target_end <= method_end) {
+            AppendResponse(output, "400 Bad Request"sv, "{\"error\":\"bad request line\"}"sv, false);
+            keep_alive = false;
+            break;
+        }
+        const string_view method = request_line.substr(0, method_end);
+        const string_view target = request_line.substr(method_end + 1, target_end - method_end - 1);
+        keep_alive = request_line.substr(target_end + 1) != "HTTP/1.0"sv;
+
+        size_t content_length = 0;
+        while (!header.empty()) {
+            const size_t end = header.find("\r\n"sv);
+            const string_view field = header.substr(0, end);
+            header.remove_prefix(end == string_view::npos ? header.size() : end + 2);
+            const size_t colon = field.find(':');
+            if (colon == string_view::npos) { continue; }
+            const string_view name = Trim(field.substr(0, colon));
+            const string_view value = Trim(field.substr(colon + 1));
+            if (EqualsIgnoreCase(name, "Content-Length"sv)) {
+                content_length = 0;
+                for (const char c : value) {
+                    content_length = isdigit(static_cast<unsigned char>(c)) ? content_length * 10 + (c - '0') : MAX_BODY + 1;
+                    if (content_length > MAX_BODY) { break; }
+                }
+            } else if (EqualsIgnoreCase(name, "Connection"sv)) {
+                keep_alive = EqualsIgnoreCase(value, "keep-alive"sv) || (keep_alive && !EqualsIgnoreCase(value, "close"sv));
+            }
+        }
+        if (content_length > MAX_BODY) {
+            AppendResponse(output, "413 Payload Too Large"sv, "{\"error\":\"body too large\"}"sv, false);
+            keep_alive = false;
+            break;
+        }
+        if (rest.size() - header_end - 4 < content_length) {
+            break;
+        }
+        string_view request_body = rest.substr(header_end + 4, content_length);
+        pos += header_end + 4 + content_length;
+
+        const size_t query = target.find('?');
+        const string_view path = target.substr(0, query);
+        body.clear();
+        if (path != "/check"sv) {
+            AppendResponse(output, "404 Not Found"sv, "{\"error\":\"not found\"}"sv, keep_alive);
+        } else if (method == "GET"sv) {
+            const string_view params = query == string_view::npos ? string_view{} : target.substr(query + 1);
+            const optional<string_view> value = FindQueryParam(params, "domain"sv);
+            if (!value) {
+                AppendResponse(output, "400 Bad Request"sv, "{\"error\":\"missing domain\"}"sv, keep_alive);
+                continue;
+            }
+            DecodeQueryValue(*value, domain);
+            AppendResult(body, domain, checker);
+            AppendResponse(output, "200 OK"sv, body, keep_alive);
+        } else if (method == "POST"sv) {
+            body += "{\"results\":[";
+            bool first = true;
+            size_t count = 0;
+            size_t matches = 0;
+            TRACE_POINT1(batch__begin, 0);
+            while (!request_body.empty()) {
+                const size_t newline = request_body.find('\n');
+                domain.assign(Trim(request_body.substr(0, newline)));
+                request_body.remove_prefix(newline == string_view::npos ? request_body.size() : newline + 1);
+                if (domain.empty()) { continue; }
+                if (!first) { body += ','; }
+                first = false;
+                ++count;
+                matches += AppendResult(body, domain, checker);
+            }
+            TRACE_POINT2(batch__end, count, matches);
+            body += "]}";
+            AppendResponse(output, "200 OK"sv, body, keep_alive);
+        } else {
+            AppendResponse(output, "405 Method Not Allowed"sv, "{\"error\":\"method not allowed\"}"sv, keep_alive);
+        }
+    }
+    input.erase(0, pos);
+    return keep_alive;
+}
+
+} // namespace http_protocol
+
+// Создаёт неблокирующий слушающий Unix-сокет по пути path (старый файл сокета удаляется).
+inline int ListenUnix(const string& path) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || path.size() >= sizeof(address.sun_path)) {
+        throw runtime_error("cannot create socket " + path);
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        throw runtime_error("cannot listen on "s + path + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+// Создаёт неблокирующий слушающий TCP-сокет только на 127.0.0.1.
+inline int ListenLoopback(uint16_t port) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw runtime_error("cannot create socket: "s + strerror(errno));
+    }
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        throw runtime_error("cannot listen on port "s + to_string(port) + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+// Текущий проверщик долгоживущих режимов. Set() атомарно подменяет его новым,
+// а потоки, уже взявшие Get(), дорабатывают со старым, пока держат shared_ptr.
+class ReloadableChecker {
+public:
+    explicit ReloadableChecker(shared_ptr<const DomainChecker> initial)
+        : current_(move(initial)) {}
+
+    shared_ptr<const DomainChecker> Get() const {
+        return atomic_load(&current_);
+    }
+
+    void Set(shared_ptr<const DomainChecker> next) {
+        atomic_store(&current_, move(next));
+    }
+
+private:
+    shared_ptr<const DomainChecker> current_;
+};
+
+// Долгоживущий сервер: список загружается один раз, запросы приходят через сокет.
+// Протокол задаётся обработчиком: он разбирает накопленный вход соединения, дописывает
+// ответы и возвращает false, если соединение нужно закрыть (после отправки ответов).
+// На каждый поток — свой epoll; слушающий сокет добавлен во все с EPOLLEXCLUSIVE,
+// так что каждый поток сам принимает соединения и дальше обслуживает их без блокировок.
+class SocketServer {
+public:
+    using Handler = bool (*)(string& input, string& output, const DomainChecker& checker);
+
+    // Забирает во владение слушающий сокет listen_fd.
+    // Проверщик берётся из checker на каждое событие, поэтому перезагрузка подхватывается сразу.
+    SocketServer(int listen_fd, Handler handler, const ReloadableChecker& checker)
+        : checker_(checker)
+        , handler_(handler)
+        , listen_fd_(listen_fd) {}
+
+    SocketServer(const SocketServer&) = delete;
+    SocketServer& operator=(const SocketServer&) = delete;
+
+    ~SocketServer() {
+        close(listen_fd_);
+    }
+
+    // Блокирует вызывающий поток, пока не будет вызван Stop().
+    void Run(size_t threads) {
+        vector<thread> workers;
+        for (size_t i = 1; i < max(threads, size_t{1}); ++i) {
+            workers.emplace_back([this] { WorkerLoop(); });
+        }
+        WorkerLoop();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void Stop() {
+        stop_.store(true);
+    }
+
+private:
+    struct Connection {
+        string input;
+        string output;
+        size_t sent = 0;
+        uint32_t events = EPOLLIN | EPOLLRDHUP;
+        // Клиент закончил передачу или обработчик попросил закрыть соединение:
+        // новый вход не читается, а закрытие ждёт, пока output не уйдёт целиком.
+        bool closing = false;
+    };
+
+    void WorkerLoop() {
+        const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event listen_event{};
+        listen_event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        listen_event.data.fd = listen_fd_;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd_, &listen_event);
+
+        unordered_map<int, Connection> connections;
+        array<epoll_event, 64> events;
+        char chunk[1 << 16];
+        while (!stop_.load()) {
+            const int ready = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 100);
+            for (int i = 0; i < ready; ++i) {
+                const int fd = events[i].data.fd;
+                if (fd == listen_fd_) {
+                    Accept(epoll_fd, connections);
+                    continue;
+                }
+                Connection& connection = connections[fd];
+                // После EPOLLHUP в сокете ещё могут лежать непрочитанные кадры,
+                // поэтому вход дочитывается до конца, а не отбрасывается.
+                bool alive = (events[i].events & EPOLLERR) == 0;
+                bool eof = false;
+                while (alive && !connection.closing && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                    const ssize_t received = read(fd, chunk, sizeof(chunk));
+                    if (received > 0) {
+                        connection.input.append(chunk, static_cast<size_t>(received));
+                        continue;
+                    }
+                    if (received < 0 && errno == EINTR) { continue; }
+                    eof = received == 0;
+                    alive = received == 0 || errno == EAGAIN;
+                    break;
+                }
+                if (alive && !connection.closing) {
+                    const bool keep = handler_(connection.input, connection.output, *checker_.Get());
+                    connection.closing = eof || !keep;
+                }
+                if (alive) {
+                    alive = Flush(epoll_fd, fd, connection) && !(connection.closing && connection.output.empty());
+                }
+                if (!alive) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                    close(fd);
+                    connections.erase(fd);
+                }
+            }
+        }
+        for (const auto& [fd, connection] : connections) {
+            close(fd);
+        }
+        close(epoll_fd);
+    }
+
+    void Accept(int epoll_fd, unordered_map<int, Connection>& connections) {
+        while (true) {
+            const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) { return; }
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            connections[fd];
+        }
+    }
+
+    // Отправляет сколько получится; остаток ждёт EPOLLOUT.
+    static bool Flush(int epoll_fd, int fd, Connection& connection) {
+        while (connection.sent < connection.output.size()) {
+            const ssize_t sent = send(fd, connection.output.data() + connection.sent,
+                                      connection.output.size() - connection.sent, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) { continue; }
+                if (errno != EAGAIN) { return false; }
+                break;
+            }
+            connection.sent += static_cast<size_t>(sent);
+        }
+        if (connection.sent == connection.output.size()) {
+            connection.output.clear();
+            connection.sent = 0;
+        }
+        // Закрывающееся соединение больше не читается: иначе EPOLLRDHUP срабатывал бы
+        // снова и снова, пока ждём EPOLLOUT.
+        const uint32_t events = (connection.closing ? 0u : uint32_t{EPOLLIN | EPOLLRDHUP})
+            | (connection.output.empty() ? 0u : uint32_t{EPOLLOUT});
+        if (events != connection.events) {
+            epoll_event event{};
+            event.events = events;
+            event.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+            connection.events = events;
+        }
+        return true;
+    }
+
+    const ReloadableChecker& checker_;
+    Handler handler_;
+    int listen_fd_ = -1;
+    atomic<bool> stop_{false};
+};
+
+// Дальше до C API — то, что нужно только исполняемому файлу: счётчик выделений,
+// режимы командной строки и тесты. В библиотеку (DOMAIN_CHECKER_LIBRARY) они не попадают.
+#ifndef DOMAIN_CHECKER_LIBRARY
+
+// Счётчик выделений памяти в текущем потоке — для проверок того, что горячие пути
+// не выделяют память (см. CountAllocations в RunTests). Глобальный operator new
+// подменяется только в исполняемом файле: библиотека не навязывает свой
+// аллокатор встраивающей программе.
+namespace allocation_counter {
+thread_local uint64_t count = 0;
+} // namespace allocation_counter
+
+// Замены не встраиваются: иначе GCC видит malloc() с одной стороны и operator delete
+// с другой (или наоборот) и предупреждает о несоответствии, хотя пара здесь согласована.
+__attribute__((noinline)) void* operator new(size_t size) {
+    ++allocation_counter::count;
+    if (void* memory = malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new(size_t size, align_val_t alignment) {
+    ++allocation_counter::count;
+    const size_t align = static_cast<size_t>(alignment);
+    if (void* memory = aligned_alloc(align, (max(size, size_t{1}) + align - 1) / align * align)) {
+        return memory;
+    }
+    throw bad_alloc();
+}
+
+// Варианты nothrow тоже подменяются: C API создаёт checker_t через new (nothrow),
+// и без них санитайзеры видят чужой operator new в паре с нашим delete.
+__attribute__((noinline)) void* operator new(size_t size, const nothrow_t&) noexcept {
+    ++allocation_counter::count;
+    return malloc(size == 0 ? 1 : size);
+}
+
+__attribute__((noinline)) void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    ++allocation_counter::count;
+    const size_t align = static_cast<size_t>(alignment);
+    return aligned_alloc(align, (max(size, size_t{1}) + align - 1) / align * align);
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, const nothrow_t&) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, align_val_t, const nothrow_t&) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, align_val_t) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t, align_val_t) noexcept {
+    free(memory);
+}
+
+namespace {
+
+// Читает из потока указанное количество доменов (по одному на строке).
+// Создаёт объекты Domain и возвращает вектор.
+// Используется для чтения как запрещённых, так и проверяемых доменов.
+vector<Domain> ReadDomains(istream& input, size_t count) {
+    vector<Domain> domains;
+    domains.reserve(count);
+    string line;
+    for (size_t i = 0; i < count; ++i) {
+        getline(input, line);
+        // Удаляем \r, если есть (для Windows)
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        domains.emplace_back(line);
+    }
+    return domains;
+}
+
+// Сколько раз f выделила память в текущем потоке.
+template <typename Func>
+uint64_t CountAllocations(Func f) {
+    const uint64_t before = allocation_counter::count;
+    f();
+    return allocation_counter::count - before;
+}
+
+// Читает число с отдельной строки.
+// Использует stringstream для преобразования строки в число любого типа (size_t, int и т.д.).
+// Применяется для чтения количества доменов.
+template <typename Number>
+Number ReadNumberOnLine(istream& input) {
+    string line;
+    getline(input, line);
+
+    Number num{};
+    std::istringstream(line) >> num;
+
+    return num;
+}
+
+// Разбирает значение опции командной строки целиком как число.
+// Возвращает nullopt, если там не только число или оно не помещается в Number.
+template <typename Number>
+optional<Number> ParseNumber(string_view text) {
+    Number value{};
+    const auto [end, error] = from_chars(text.data(), text.data() + text.size(), value);
+    if (error != errc{} || end != text.data() + text.size()) {
+        return nullopt;
+    }
+    return value;
+}
+
+// Порт TCP из командной строки: от 1 до 65535.
+inline optional<uint16_t> ParsePort(string_view text) {
+    const optional<uint16_t> port = ParseNumber<uint16_t>(text);
+    if (!port || *port == 0) {
+        return nullopt;
+    }
+    return port;
+}
+
+// Загружает список как отсортированные по ReversedLess обращённые домены.
+// Понимает и скомпилированный индекс (ключи уже отсортированы),
+// и текстовый формат: число на первой строке и домены по одному на строке.
+vector<string> LoadSortedReversed(const string& path) {
+    vector<string> keys;
+    ifstream input(path, ios::binary);
+    if (!input) {
+        throw runtime_error("cannot open " + path);
+    }
+    string magic(CompiledDomainIndex::MAGIC.size(), '\0');
+    input.read(magic.data(), magic.size());
+    if (magic == CompiledDomainIndex::MAGIC) {
+        const CompiledDomainIndex index = CompiledDomainIndex::Open(path);
+        keys.reserve(index.Size());
+        for (size_t i = 0; i < index.Size(); ++i) {
+            keys.emplace_back(index.GetReversed(i));
+        }
+        return keys;
+    }
+
+    input.clear();
+    input.seekg(0);
+    for (const Domain& domain : ReadDomains(input, ReadNumberOnLine<size_t>(input))) {
+        keys.push_back(domain.GetReversed());
+    }
+    sort(keys.begin(), keys.end(), ReversedLess);
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+}
+
+// Режим --diff: печатает дельту от старого списка к новому в формате журнала.
+// Узлы применяют её через DurableDomainIndex::Apply вместо полной перестройки.
+int RunDiff(const string& old_path, const string& new_path, ostream& output) {
+    try {
+        const vector<string> old_keys = LoadSortedReversed(old_path);
+        const vector<string> new_keys = LoadSortedReversed(new_path);
+        DiffSortedReversed(old_keys, new_keys, [&output](const LogRecord& record) {
+            WriteLogRecord(output, record);
+        });
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Режим --set OP LHS RHS OUT: комбинирует два списка (текстовых или скомпилированных)
+// и сразу записывает результат в формате CompiledDomainIndex.
+int RunSetOperation(string_view op_name, const string& lhs_path, const string& rhs_path, const string& out_path) {
+    SetOperation op;
+    if (op_name == "union"sv) {
+        op = SetOperation::UNION;
+    } else if (op_name == "intersect"sv) {
+        op = SetOperation::INTERSECTION;
+    } else if (op_name == "subtract"sv) {
+        op = SetOperation::DIFFERENCE;
+    } else {
+        cerr << "unknown set operation: " << op_name << endl;
+        return 1;
+    }
+    try {
+        const vector<string> result = CombineSortedReversed(LoadSortedReversed(lhs_path), LoadSortedReversed(rhs_path), op);
+        WriteFileAtomically(out_path, CompiledDomainIndex::Build(result));
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Длительность фаз пакетного прогона main (--timing): чтение списков, построение
+// проверщика, проверка и вывод, с пропускной способностью каждой фазы.
+// Время снимается только на границах фаз, поэтому выключенный таймер не стоит ничего,
+// а включённый не замедляет циклы внутри фаз.
+class PhaseTimer {
+public:
+    enum class Format {
+        TEXT,  // таблица для человека
+        JSON,  // одна строка {"phases":[...],"total_seconds":...}
+    };
+
+    explicit PhaseTimer(bool enabled)
+        : enabled_(enabled)
+        , start_(enabled ? chrono::steady_clock::now() : chrono::steady_clock::time_point{}) {}
+
+    // Завершает фазу, начавшуюся с конца предыдущей: обработано items единиц unit
+    // (пустой unit — у фазы нет осмысленной пропускной способности).
+    void Finish(string_view name, uint64_t items, string_view unit) {
+        if (!enabled_) { return; }
+        const auto now = chrono::steady_clock::now();
+        phases_.push_back({name, chrono::duration<double>(now - start_).count(), items, unit});
+        start_ = now;
+    }
+
+    // Переносит seconds из фазы from в фазу to: например, запись вывода,
+    // случившуюся посреди цикла проверки. Переносится не больше, чем набрала from,
+    // чтобы погрешность замеров не давала фазам отрицательной длительности.
+    void Transfer(string_view from, string_view to, double seconds) {
+        const auto named = [this](string_view name) {
+            return find_if(phases_.begin(), phases_.end(), [name](const Phase& phase) { return phase.name == name; });
+        };
+        const auto source = named(from);
+        const auto target = named(to);
+        if (source == phases_.end() || target == phases_.end()) { return; }
+        const double moved = clamp(seconds, 0.0, source->seconds);
+        source->seconds -= moved;
+        target->seconds += moved;
+    }
+
+    void Report(ostream& output, Format format) const {
+        if (!enabled_) { return; }
+        double total = 0;
+        for (const Phase& phase : phases_) {
+            total += phase.seconds;
+        }
+        const auto rate = [](const Phase& phase) {
+            return phase.seconds > 0 ? static_cast<double>(phase.items) / phase.seconds : 0.0;
+        };
+        ostringstream report;
+        if (format == Format::JSON) {
+            report << "{\"phases\":[";
+            for (size_t i = 0; i < phases_.size(); ++i) {
+                const Phase& phase = phases_[i];
+                report << (i == 0 ? "" : ",") << "{\"name\":\"" << phase.name << "\",\"seconds\":" << phase.seconds
+                       << ",\"items\":" << phase.items << ",\"unit\":\"" << phase.unit
+                       << "\",\"per_second\":" << rate(phase) << '}';
+            }
+            report << "],\"total_seconds\":" << total << "}\n";
+        } else {
+            report << left << setw(14) << "phase" << right << setw(12) << "ms" << setw(8) << "share" << setw(12)
+                   << "items" << setw(16) << "per second" << '\n' << fixed;
+            for (const Phase& phase : phases_) {
+                report << left << setw(14) << phase.name << right << setprecision(2) << setw(12) << phase.seconds * 1e3
+                       << setprecision(1) << setw(7) << (total > 0 ? phase.seconds * 100 / total : 0) << '%'
+                       << setw(12) << phase.items;
+                if (!phase.unit.empty()) {
+                    report << setprecision(0) << setw(16) << rate(phase) << ' ' << phase.unit << "/s";
+                }
+                report << '\n';
+            }
+            report << left << setw(14) << "total" << right << setprecision(2) << setw(12) << total * 1e3 << '\n';
+        }
+        output << report.str() << flush;
+    }
+
+private:
+    struct Phase {
+        string_view name;
+        double seconds = 0;
+        uint64_t items = 0;
+        string_view unit;
+    };
+
+    bool enabled_;
+    chrono::steady_clock::time_point start_;
+    vector<Phase> phases_;
+};
+
+// Настройки основного режима проверки.
+struct CheckOptions {
+    // Файл защищённых брендов; похожие на них разрешённые домены помечаются "Suspicious".
+    string brands_path;
+    // Оценивать разрешённые домены DgaScorer и помечать сгенерированные как "Suspicious".
+    bool dga = false;
+    // Файл асинхронного журнала заблокированных запросов (AsyncMatchLogger).
+    string match_log_path;
+    OutputFormat format = OutputFormat::PLAIN;
+    // Серверный режим: список запрещённых доменов берётся из list_path, а не из stdin.
+    string list_path;
+    string serve_unix_path;
+    uint16_t serve_http_port = 0;
+    // Отчёт о длительности фаз прогона в stderr (--timing или --timing-json).
+    optional<PhaseTimer::Format> timing;
+};
+
+optional<CheckOptions> ParseCheckOptions(const vector<string_view>& args) {
+    CheckOptions options;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--brands"sv && i + 1 < args.size()) {
+            options.brands_path = string(args[++i]);
+        } else if (args[i] == "--dga"sv) {
+            options.dga = true;
+        } else if (args[i] == "--log-matches"sv && i + 1 < args.size()) {
+            options.match_log_path = string(args[++i]);
+        } else if (args[i] == "--timing"sv) {
+            options.timing = PhaseTimer::Format::TEXT;
+        } else if (args[i] == "--timing-json"sv) {
+            options.timing = PhaseTimer::Format::JSON;
+        } else if (args[i] == "--list"sv && i + 1 < args.size()) {
+            options.list_path = string(args[++i]);
+        } else if (args[i] == "--serve-unix"sv && i + 1 < args.size()) {
+            options.serve_unix_path = string(args[++i]);
+        } else if (args[i] == "--serve-http"sv && i + 1 < args.size()) {
+            const optional<uint16_t> port = ParsePort(args[++i]);
+            if (!port) {
+                cerr << "bad port for --serve-http: " << args[i] << " (expected 1-65535)" << endl;
+                return nullopt;
+            }
+            options.serve_http_port = *port;
+        } else if (args[i] == "--format"sv && i + 1 < args.size()) {
+            const string_view format = args[++i];
+            if (format == "plain"sv) {
+                options.format = OutputFormat::PLAIN;
+            } else if (format == "jsonl"sv) {
+                options.format = OutputFormat::JSONL;
+            } else if (format == "tsv"sv) {
+                options.format = OutputFormat::TSV;
+            } else {
+                cerr << "unknown output format: " << format << endl;
+                return nullopt;
+            }
+        } else {
+            cerr << "unknown option: " << args[i] << endl;
+            return nullopt;
+        }
+    }
+    if ((!options.serve_unix_path.empty() || options.serve_http_port != 0) && options.list_path.empty()) {
+        cerr << "server modes require --list" << endl;
+        return nullopt;
+    }
+    return options;
+}
+
+vector<Domain> ReadDomainsFile(const string& path) {
+    ifstream input(path);
+    if (!input) {
+        throw runtime_error("cannot open " + path);
+    }
+    return ReadDomains(input, ReadNumberOnLine<size_t>(input));
+}
+
+// Читает список строже, чем ReadDomainsFile: число на первой строке должно разбираться
+// целиком, а доменов должно быть ровно столько, сколько объявлено. Иначе файл, скорее всего,
+// ещё дописывается или испорчен, и подменять им рабочий список нельзя.
+vector<Domain> ReadCompleteDomainsFile(const string& path) {
+    ifstream input(path);
+    if (!input) {
+        throw runtime_error("cannot open " + path);
+    }
+    string line;
+    const auto next_line = [&input, &line] {
+        if (!getline(input, line)) { return false; }
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        return true;
+    };
+    next_line();
+    const optional<size_t> count = ParseNumber<size_t>(line);
+    if (!count) {
+        throw runtime_error("bad domain count in " + path + ": \"" + line + "\"");
+    }
+    vector<Domain> domains;
+    while (next_line()) {
+        if (domains.size() < *count) {
+            domains.emplace_back(line);
+        } else if (!line.empty()) {
+            throw runtime_error(path + " has more than the declared " + to_string(*count) + " domains");
+        }
+    }
+    if (domains.size() != *count) {
+        throw runtime_error(path + " declares " + to_string(*count) + " domains but has "
+                            + to_string(domains.size()));
+    }
+    return domains;
+}
+
+// Режим --http-load PORT: простой генератор нагрузки для --serve-http.
+// Каждый поток держит keep-alive соединение и шлёт пакетные POST /check по BATCH доменов
+// в течение seconds секунд; в конце печатается число проверок в секунду.
+int RunHttpLoad(uint16_t port, size_t threads, double seconds) {
+    constexpr size_t BATCH = 1000;
+    string body;
+    for (size_t i = 0; i < BATCH; ++i) {
+        body += "host" + to_string(i) + (i % 2 ? ".gdz.ru\n" : ".example.com\n");
+    }
+    const string request = "POST /check HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: "
+                         + to_string(body.size()) + "\r\n\r\n" + body;
+
+    atomic<uint64_t> lookups{0};
+    const auto deadline = chrono::steady_clock::now() + chrono::duration<double>(seconds);
+    vector<thread> workers;
+    for (size_t t = 0; t < max(threads, size_t{1}); ++t) {
+        workers.emplace_back([&] {
+            const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+                close(fd);
+                return;
+            }
+            string response;
+            char chunk[1 << 16];
+            while (chrono::steady_clock::now() < deadline) {
+                if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+                    break;
+                }
+                response.clear();
+                size_t expected = string::npos;
+                while (response.size() < expected) {
+                    const ssize_t received = read(fd, chunk, sizeof(chunk));
+                    if (received <= 0) {
+                        close(fd);
+                        return;
+                    }
+                    response.append(chunk, static_cast<size_t>(received));
+                    const size_t header_end = response.find("\r\n\r\n");
+                    const size_t length_at = response.find("Content-Length: ");
+                    if (expected == string::npos && header_end != string::npos && length_at < header_end) {
+                        expected = header_end + 4 + stoul(response.substr(length_at + 16));
+                    }
+                }
+                lookups += BATCH;
+            }
+            close(fd);
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    cout << lookups.load() << " lookups in " << seconds << " s: "
+         << static_cast<uint64_t>(lookups.load() / seconds) << " lookups/s" << endl;
+    return 0;
+}
+
+// Аппаратные счётчики производительности текущего потока через perf_event_open.
+// Каждый счётчик открывается отдельно, а не группой: недоступный счётчик (нет PMU
+// в виртуальной машине, запрет perf_event_paranoid или seccomp) не мешает остальным.
+// Если ядро мультиплексирует счётчики, значения масштабируются по времени их работы.
+class PerfCounters {
+public:
+    struct Event {
+        string_view name;
+        uint32_t type;
+        uint64_t config;
+    };
+
+    static constexpr size_t EVENT_COUNT = 6;
+    using Values = array<optional<double>, EVENT_COUNT>;
+
+    static const array<Event, EVENT_COUNT>& Events() {
+        static constexpr auto cache_miss = [](uint64_t cache) {
+            return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        static const array<Event, EVENT_COUNT> events = {{
+            {"cycles"sv, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {"instructions"sv, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {"L1d-misses"sv, PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D)},
+            {"LLC-misses"sv, PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL)},
+            {"dTLB-misses"sv, PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB)},
+            {"branch-misses"sv, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        }};
+        return events;
+    }
+
+    PerfCounters() {
+        for (size_t i = 0; i < EVENT_COUNT; ++i) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = Events()[i].type;
+            attr.config = Events()[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+        for (const int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    bool Available() const {
+        return any_of(fds_.begin(), fds_.end(), [](int fd) { return fd >= 0; });
+    }
+
+    void Start() {
+        for (const int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    // Останавливает счётчики и возвращает их значения; nullopt — счётчик недоступен.
+    Values Stop() {
+        Values values;
+        for (size_t i = 0; i < EVENT_COUNT; ++i) {
+            if (fds_[i] < 0) { continue; }
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t data[3] = {};  // значение, время включения, время работы
+            if (read(fds_[i], data, sizeof(data)) == static_cast<ssize_t>(sizeof(data)) && data[2] != 0) {
+                values[i] = static_cast<double>(data[0]) * static_cast<double>(data[1]) / static_cast<double>(data[2]);
+            }
+        }
+        return values;
+    }
+
+private:
+    array<int, EVENT_COUNT> fds_{};
+};
+
+// Время и счётчики одной фазы бенчмарка (построения или проверок).
+struct PhaseMeasurement {
+    double seconds = 0;
+    uint64_t operations = 0;
+    PerfCounters::Values counters;
+};
+
+template <typename Func>
+PhaseMeasurement MeasurePhase(PerfCounters& counters, uint64_t operations, Func f) {
+    PhaseMeasurement result;
+    result.operations = max<uint64_t>(operations, 1);
+    counters.Start();
+    const auto start = chrono::steady_clock::now();
+    f();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.counters = counters.Stop();
+    return result;
+}
+
+// Замеры одного вида проверщика по повторам бенчмарка.
+struct BenchResult {
+    string backend;
+    vector<PhaseMeasurement> build;
+    vector<PhaseMeasurement> query;
+    uint64_t matches = 0;  // в последнем повторе, для сверки видов между собой
+};
+
+// Вызывает visit(имя, build) для каждого вида проверщика; build() строит его по list.
+template <typename Visit>
+void ForEachBackend(const vector<Domain>& list, Visit visit) {
+    visit("map", [&] {
+        return DomainChecker(list.begin(), list.end());
+    });
+    visit("overlay", [&] {
+        const vector<Domain> none;
+        return OverlayDomainChecker(make_shared<const DomainChecker>(list.begin(), list.end()),
+                                    none.begin(), none.end(), none.begin(), none.end());
+    });
+    visit("trie", [&] {
+        PersistentDomainTrie trie;
+        for (const Domain& domain : list) {
+            trie = trie.Insert(domain);
+        }
+        return trie;
+    });
+    visit("compiled", [&] {
+        return CompiledDomainIndex::FromBytes(CompiledDomainIndex::Compile(list.begin(), list.end()));
+    });
+}
+
+// Строит проверщик функцией build и проверяет все queries rounds раз; так repetitions повторов.
+template <typename Build>
+BenchResult BenchBackend(string backend, PerfCounters& counters, size_t rules, const vector<Domain>& queries,
+                         size_t rounds, size_t repetitions, Build build) {
+    BenchResult result;
+    result.backend = move(backend);
+    for (size_t repetition = 0; repetition < repetitions; ++repetition) {
+        optional<decltype(build())> checker;
+        result.build.push_back(MeasurePhase(counters, rules, [&] { checker.emplace(build()); }));
+        uint64_t matches = 0;
+        result.query.push_back(MeasurePhase(counters, queries.size() * rounds, [&] {
+            for (size_t round = 0; round < rounds; ++round) {
+                for (const Domain& domain : queries) {
+                    matches += checker->IsForbidden(domain);
+                }
+            }
+        }));
+        result.matches = matches / rounds;
+    }
+    return result;
+}
+
+// Среднее и выборочное стандартное отклонение.
+struct SampleStats {
+    double mean = 0;
+    double stddev = 0;
+    size_t count = 0;
+};
+
+SampleStats Summarize(const vector<double>& samples) {
+    SampleStats stats;
+    stats.count = samples.size();
+    if (samples.empty()) { return stats; }
+    for (const double sample : samples) {
+        stats.mean += sample;
+    }
+    stats.mean /= static_cast<double>(samples.size());
+    if (samples.size() > 1) {
+        double squares = 0;
+        for (const double sample : samples) {
+            squares += (sample - stats.mean) * (sample - stats.mean);
+        }
+        stats.stddev = sqrt(squares / static_cast<double>(samples.size() - 1));
+    }
+    return stats;
+}
+
+// Квантиль 0.975 распределения Стьюдента — множитель для двустороннего 95% интервала.
+// Дробные степени свободы (у Уэлча) округляются вниз, то есть интервал берётся с запасом.
+double StudentT975(double degrees_of_freedom) {
+    static constexpr array<double, 30> table = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (!(degrees_of_freedom >= 1)) { return table[0]; }
+    if (degrees_of_freedom > table.size()) { return 1.960; }
+    return table[static_cast<size_t>(degrees_of_freedom) - 1];
+}
+
+// Половина ширины 95% доверительного интервала для среднего.
+double ConfidenceHalfWidth(const SampleStats& stats) {
+    if (stats.count < 2) { return 0; }
+    return StudentT975(static_cast<double>(stats.count - 1)) * stats.stddev / sqrt(static_cast<double>(stats.count));
+}
+
+vector<double> NanosPerOperation(const vector<PhaseMeasurement>& measurements) {
+    vector<double> result;
+    for (const PhaseMeasurement& measurement : measurements) {
+        result.push_back(measurement.seconds * 1e9 / static_cast<double>(measurement.operations));
+    }
+    return result;
+}
+
+// Среднее по повторам значение счётчика i на операцию; nullopt, если счётчик недоступен.
+optional<double> CounterPerOperation(const vector<PhaseMeasurement>& measurements, size_t i) {
+    vector<double> values;
+    for (const PhaseMeasurement& measurement : measurements) {
+        if (measurement.counters[i]) {
+            values.push_back(*measurement.counters[i] / static_cast<double>(measurement.operations));
+        }
+    }
+    if (values.empty()) { return nullopt; }
+    return Summarize(values).mean;
+}
+
+// Печатает фазу: среднее время на операцию ± 95% интервал и счётчики на операцию ("-" — недоступен).
+void PrintPhase(ostream& output, const string& backend, string_view phase, const vector<PhaseMeasurement>& measurements) {
+    const SampleStats nanos = Summarize(NanosPerOperation(measurements));
+    output << left << setw(12) << backend << setw(7) << phase << right << setw(10) << measurements.front().operations
+           << fixed << setprecision(1) << setw(10) << nanos.mean << " ±" << setw(7) << ConfidenceHalfWidth(nanos);
+    for (size_t i = 0; i < PerfCounters::EVENT_COUNT; ++i) {
+        output << ' ' << setw(16);
+        if (const optional<double> value = CounterPerOperation(measurements, i)) {
+            output << setprecision(2) << *value;
+        } else {
+            output << "-";
+        }
+    }
+    output << defaultfloat << '\n';
+}
+
+// Пишет фазу строкой JSON-массива "results" (см. ReadBenchJson).
+void WritePhaseJson(ostream& output, const string& backend, string_view phase,
+                    const vector<PhaseMeasurement>& measurements) {
+    output << "{\"backend\":\"" << backend << "\",\"operation\":\"" << phase
+           << "\",\"operations\":" << measurements.front().operations << ",\"ns_per_op\":[" << setprecision(6);
+    const vector<double> nanos = NanosPerOperation(measurements);
+    for (size_t i = 0; i < nanos.size(); ++i) {
+        output << (i == 0 ? "" : ",") << nanos[i];
+    }
+    output << "],\"counters_per_op\":{";
+    for (size_t i = 0; i < PerfCounters::EVENT_COUNT; ++i) {
+        output << (i == 0 ? "" : ",") << '"' << PerfCounters::Events()[i].name << "\":";
+        if (const optional<double> value = CounterPerOperation(measurements, i)) {
+            output << *value;
+        } else {
+            output << "null";
+        }
+    }
+    output << "}}";
+}
+
+// Режим --bench LIST QUERIES [--repetitions N] [--json FILE]: строит каждый вид проверщика
+// по списку LIST и прогоняет по нему домены из QUERIES (форматы как у --list), всего около
+// миллиона проверок на повтор. Для фаз построения (на одно правило) и проверок (на один запрос)
+// печатаются среднее время с 95% интервалом по повторам и аппаратные счётчики;
+// счётчики покрывают только вызывающий поток. С --json замеры всех повторов сохраняются
+// для сравнения режимом --bench-compare.
+int RunBench(const string& list_path, const string& queries_path, size_t repetitions, const string& json_path) {
+    try {
+        constexpr size_t TARGET_QUERIES = 1'000'000;
+        const vector<Domain> list = ReadDomainsFile(list_path);
+        const vector<Domain> queries = ReadDomainsFile(queries_path);
+        if (queries.empty() || repetitions == 0) {
+            cerr << "no queries in " << queries_path << " or no repetitions" << endl;
+            return 1;
+        }
+        const size_t rounds = max<size_t>(1, TARGET_QUERIES / queries.size());
+
+        PerfCounters counters;
+        if (!counters.Available()) {
+            cerr << "hardware counters are unavailable (check perf_event_paranoid); reporting time only" << endl;
+        }
+
+        vector<BenchResult> results;
+        ForEachBackend(list, [&](string name, auto build) {
+            results.push_back(BenchBackend(move(name), counters, list.size(), queries, rounds, repetitions, build));
+        });
+
+        cout << left << setw(12) << "backend" << setw(7) << "phase" << right << setw(10) << "ops" << setw(19) << "ns/op (95% CI)";
+        for (const PerfCounters::Event& event : PerfCounters::Events()) {
+            cout << ' ' << setw(16) << string(event.name) + "/op";
+        }
+        cout << '\n';
+        for (const BenchResult& result : results) {
+            PrintPhase(cout, result.backend, "build"sv, result.build);
+            PrintPhase(cout, result.backend, "query"sv, result.query);
+        }
+        for (const BenchResult& result : results) {
+            cout << result.backend << ": " << result.matches << " of " << queries.size() << " queries forbidden\n";
+        }
+        cout.flush();
+
+        if (!json_path.empty()) {
+            ostringstream json;
+            json << "{\"format\":\"domain-checker-bench\",\"version\":1,\"repetitions\":" << repetitions
+                 << ",\"rules\":" << list.size() << ",\"queries\":" << queries.size() << ",\"results\":[\n";
+            for (size_t i = 0; i < results.size(); ++i) {
+                WritePhaseJson(json, results[i].backend, "build"sv, results[i].build);
+                json << ",\n";
+                WritePhaseJson(json, results[i].backend, "query"sv, results[i].query);
+                json << (i + 1 < results.size() ? ",\n" : "\n");
+            }
+            json << "]}\n";
+            WriteFileAtomically(json_path, json.str());
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Замеры ns/op по (виду проверщика, операции) из файла, записанного --bench --json.
+// Разбирается только этот формат: по объекту результата на строку.
+map<pair<string, string>, vector<double>> ReadBenchJson(const string& path) {
+    ifstream input(path);
+    if (!input) {
+        throw runtime_error("cannot open " + path);
+    }
+    const auto string_field = [](const string& line, string_view key) {
+        const string marker = "\"" + string(key) + "\":\"";
+        const size_t begin = line.find(marker);
+        if (begin == string::npos) { return string(); }
+        const size_t value = begin + marker.size();
+        return line.substr(value, line.find('"', value) - value);
+    };
+    map<pair<string, string>, vector<double>> results;
+    string line;
+    while (getline(input, line)) {
+        if (line.rfind("{\"backend\":", 0) != 0) { continue; }
+        vector<double>& samples = results[{string_field(line, "backend"sv), string_field(line, "operation"sv)}];
+        const size_t array = line.find("\"ns_per_op\":[");
+        if (array == string::npos) {
+            throw runtime_error("bad benchmark result in " + path);
+        }
+        const char* cursor = line.c_str() + line.find('[', array);  // '[' или ',' перед каждым числом
+        while (*cursor != ']' && *cursor != '\0') {
+            char* end = nullptr;
+            samples.push_back(strtod(cursor + 1, &end));
+            if (end == cursor + 1) {
+                throw runtime_error("bad benchmark result in " + path);
+            }
+            cursor = end;
+        }
+    }
+    if (results.empty()) {
+        throw runtime_error("no benchmark results in " + path);
+    }
+    return results;
+}
+
+// Режим --bench-compare BASE NEW [--threshold PCT]: сравнивает два прогона --bench --json.
+// Для каждой пары (вид, операция) печатает средние с 95% интервалами и изменение в процентах
+// с интервалом по t-критерию Уэлча. Регрессия — интервал изменения целиком выше нуля
+// и само изменение больше порога; улучшение — симметрично. Код выхода 1, если есть регрессии.
+int RunBenchCompare(const string& base_path, const string& new_path, double threshold_percent) {
+    try {
+        const auto base = ReadBenchJson(base_path);
+        const auto candidate = ReadBenchJson(new_path);
+        size_t regressions = 0;
+        cout << left << setw(12) << "backend" << setw(7) << "phase" << right << setw(22) << "base ns/op"
+             << setw(22) << "new ns/op" << setw(26) << "change (95% CI)" << "  verdict\n"
+             << fixed << setprecision(1);
+        for (const auto& [key, base_samples] : base) {
+            const auto it = candidate.find(key);
+            if (it == candidate.end()) { continue; }
+            const SampleStats before = Summarize(base_samples);
+            const SampleStats after = Summarize(it->second);
+
+            const double difference = after.mean - before.mean;
+            const double before_variance = before.count > 1 ? before.stddev * before.stddev / before.count : 0;
+            const double after_variance = after.count > 1 ? after.stddev * after.stddev / after.count : 0;
+            const double standard_error = sqrt(before_variance + after_variance);
+            double half_width = 0;
+            if (standard_error > 0) {
+                const double degrees_of_freedom = pow(standard_error, 4)
+                    / ((before.count > 1 ? before_variance * before_variance / (before.count - 1) : 0)
+                       + (after.count > 1 ? after_variance * after_variance / (after.count - 1) : 0));
+                half_width = StudentT975(degrees_of_freedom) * standard_error;
+            }
+            const double scale = before.mean > 0 ? 100 / before.mean : 0;
+            const double change = difference * scale;
+
+            string_view verdict = "~"sv;
+            if (before.count < 2 || after.count < 2) {
+                verdict = "? (need 2+ repetitions)"sv;
+            } else if (difference - half_width > 0 && change > threshold_percent) {
+                verdict = "REGRESSION"sv;
+                ++regressions;
+            } else if (difference + half_width < 0 && -change > threshold_percent) {
+                verdict = "improvement"sv;
+            }
+
+            ostringstream change_text;
+            change_text << fixed << setprecision(1) << showpos << change << "% [" << (difference - half_width) * scale
+                        << ", " << (difference + half_width) * scale << "]";
+            const auto mean_text = [](const SampleStats& stats) {
+                ostringstream text;
+                text << fixed << setprecision(1) << stats.mean << " ±" << ConfidenceHalfWidth(stats);
+                return text.str();
+            };
+            cout << left << setw(12) << key.first << setw(7) << key.second << right << setw(22) << mean_text(before)
+                 << setw(22) << mean_text(after) << setw(26) << change_text.str() << "  " << verdict << '\n';
+        }
+        cout << defaultfloat << regressions << " regression(s) above " << threshold_percent << "%" << endl;
+        return regressions == 0 ? 0 : 1;
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+}
+
+// Гистограмма задержек в наносекундах с логарифмическими корзинами: по 16 корзин
+// на каждую степень двойки, то есть относительная погрешность перцентиля не больше 1/16.
+// Запись — пара битовых операций и инкремент, без выделений памяти.
+class LatencyHistogram {
+public:
+    void Record(uint64_t nanos) {
+        ++counts_[Bucket(nanos)];
+        ++total_;
+        max_ = max(max_, nanos);
+    }
+
+    void Merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        max_ = max(max_, other.max_);
+    }
+
+    uint64_t Count() const {
+        return total_;
+    }
+
+    uint64_t Max() const {
+        return max_;
+    }
+
+    // Верхняя граница корзины, в которую попадает доля q всех замеров.
+    uint64_t Percentile(double q) const {
+        const auto rank = static_cast<uint64_t>(ceil(q * static_cast<double>(total_)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= max<uint64_t>(rank, 1)) {
+                return min(UpperBound(i), max_);
+            }
+        }
+        return max_;
+    }
+
+private:
+    static constexpr size_t SUB_BUCKETS = 16;
+
+    static size_t Bucket(uint64_t nanos) {
+        if (nanos < SUB_BUCKETS) { return static_cast<size_t>(nanos); }
+        const size_t exponent = 63 - static_cast<size_t>(__builtin_clzll(nanos));
+        const size_t mantissa = static_cast<size_t>(nanos >> (exponent - 4)) & (SUB_BUCKETS - 1);
+        return (exponent - 3) * SUB_BUCKETS + mantissa;
+    }
+
+    static uint64_t UpperBound(size_t bucket) {
+        if (bucket < SUB_BUCKETS) { return bucket; }
+        const size_t exponent = bucket / SUB_BUCKETS + 3;
+        const uint64_t mantissa = bucket % SUB_BUCKETS;
+        return ((SUB_BUCKETS + mantissa + 1) << (exponent - 4)) - 1;
+    }
+
+    array<uint64_t, 61 * SUB_BUCKETS> counts_{};
+    uint64_t total_ = 0;
+    uint64_t max_ = 0;
+};
+
+// Параметры --bench-churn.
+struct ChurnOptions {
+    size_t readers = max(thread::hardware_concurrency(), 2u) - 1;
+    double updates_per_second = 10;
+    size_t delta_size = 100;
+    double seconds = 3;
+};
+
+// Итог прогона одной стратегии обновления.
+struct ChurnResult {
+    LatencyHistogram latency;
+    uint64_t updates = 0;
+    double update_seconds = 0;  // суммарное время применения и публикации обновлений
+    uint64_t matches = 0;
+};
+
+// Поток дельт для --bench-churn: чётная пачка удаляет delta_size доменов списка,
+// следующая возвращает их обратно, так что размер списка остаётся прежним.
+vector<LogRecord> ChurnDelta(const vector<Domain>& list, size_t delta_size, uint64_t update) {
+    vector<LogRecord> records;
+    const size_t start = static_cast<size_t>(update / 2) * delta_size;
+    for (size_t i = 0; i < delta_size && !list.empty(); ++i) {
+        records.push_back({update % 2 == 1, list[(start + i) % list.size()].ToString()});
+    }
+    return records;
+}
+
+// Запускает options.readers потоков, проверяющих queries через check(view, domain), и писателя,
+// вызывающего update(номер) с заданной частотой (или без пауз, если не успевает).
+// Читатель берёт view = snapshot() раз на READ_BATCH проверок, как сервер на пакет запросов.
+// Задержка каждой проверки замеряется отдельно; время snapshot() входит в первую проверку пачки.
+template <typename Snapshot, typename Check, typename Update>
+ChurnResult RunChurn(const ChurnOptions& options, const vector<Domain>& queries, Snapshot snapshot, Check check,
+                     Update update) {
+    constexpr size_t READ_BATCH = 64;
+    atomic<bool> stop{false};
+    atomic<uint64_t> matches{0};  // чтобы оптимизатор не выбросил проверки
+    vector<LatencyHistogram> histograms(options.readers);
+    vector<thread> readers;
+    for (size_t r = 0; r < options.readers; ++r) {
+        readers.emplace_back([&, r] {
+            LatencyHistogram& histogram = histograms[r];
+            uint64_t forbidden = 0;
+            for (size_t i = r * queries.size() / options.readers; !stop.load(memory_order_relaxed);) {
+                auto start = chrono::steady_clock::now();
+                const auto view = snapshot();
+                for (const size_t end = i + READ_BATCH; i < end; ++i) {
+                    forbidden += check(view, queries[i % queries.size()]);
+                    const auto finish = chrono::steady_clock::now();
+                    histogram.Record(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+                        finish - start).count()));
+                    start = finish;
+                }
+            }
+            matches.fetch_add(forbidden, memory_order_relaxed);
+        });
+    }
+
+    ChurnResult result;
+    const auto begin = chrono::steady_clock::now();
+    const auto deadline = begin + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(options.seconds));
+    const auto period = chrono::duration<double>(options.updates_per_second > 0 ? 1 / options.updates_per_second : 0);
+    for (auto next = begin; chrono::steady_clock::now() < deadline;) {
+        next += chrono::duration_cast<chrono::steady_clock::duration>(period);
+        this_thread::sleep_until(min(next, deadline));
+        if (chrono::steady_clock::now() >= deadline) { break; }
+        const auto start = chrono::steady_clock::now();
+        update(result.updates++);
+        result.update_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    stop = true;
+    for (thread& reader : readers) {
+        reader.join();
+    }
+    for (const LatencyHistogram& histogram : histograms) {
+        result.latency.Merge(histogram);
+    }
+    result.matches = matches.load();
+    return result;
+}
+
+// Режим --bench-churn LIST QUERIES [--readers N] [--rate UPDATES_PER_SECOND] [--delta K] [--seconds S]:
+// читатели проверяют QUERIES, пока писатель меняет список LIST пачками по K доменов
+// (--rate 0 — обновления без пауз, чтобы узнать предельную частоту).
+// Сравниваются две стратегии обновления:
+//   delta — VersionedDomainChecker::Apply поверх общей версии (читатели берут снимок на пачку);
+//   swap  — новый DomainChecker строится целиком и подменяется в ReloadableChecker.
+// Печатаются пропускная способность читателей, перцентили задержки проверки
+// и достигнутая частота и средняя длительность обновлений.
+int RunChurnBench(const string& list_path, const string& queries_path, const ChurnOptions& options) {
+    try {
+        const vector<Domain> list = ReadDomainsFile(list_path);
+        const vector<Domain> queries = ReadDomainsFile(queries_path);
+        if (queries.empty() || options.readers == 0) {
+            cerr << "no queries in " << queries_path << " or no readers" << endl;
+            return 1;
+        }
+
+        vector<pair<string_view, ChurnResult>> results;
+        {
+            VersionedDomainChecker versioned(8);
+            PersistentDomainTrie trie;
+            for (const Domain& domain : list) {
+                trie = trie.Insert(domain);
+            }
+            versioned.Reset(move(trie));
+            results.emplace_back("delta"sv, RunChurn(options, queries,
+                [&] { return versioned.Snapshot(); },
+                [](const PersistentDomainTrie& version, const Domain& domain) { return version.IsForbidden(domain); },
+                [&](uint64_t update) { versioned.Apply(ChurnDelta(list, options.delta_size, update)); }));
+        }
+        {
+            ReloadableChecker reloadable(make_shared<const DomainChecker>(list.begin(), list.end()));
+            set<Domain> current(list.begin(), list.end());
+            results.emplace_back("swap"sv, RunChurn(options, queries,
+                [&] { return reloadable.Get(); },
+                [](const shared_ptr<const DomainChecker>& checker, const Domain& domain) { return checker->IsForbidden(domain); },
+                [&](uint64_t update) {
+                    for (const LogRecord& record : ChurnDelta(list, options.delta_size, update)) {
+                        if (record.add) {
+                            current.emplace(record.domain);
+                        } else {
+                            current.erase(Domain(record.domain));
+                        }
+                    }
+                    reloadable.Set(make_shared<const DomainChecker>(current.begin(), current.end()));
+                }));
+        }
+
+        cout << options.readers << " readers, " << list.size() << " rules, target " << options.updates_per_second
+             << " updates/s of " << options.delta_size << " domains, " << options.seconds << " s per strategy\n";
+        cout << left << setw(10) << "strategy" << right << setw(12) << "reads/s" << setw(10) << "p50 ns" << setw(10)
+             << "p99 ns" << setw(11) << "p99.9 ns" << setw(12) << "max ns" << setw(12) << "updates/s" << setw(13)
+             << "update ms" << '\n' << fixed << setprecision(1);
+        for (const auto& [strategy, result] : results) {
+            const LatencyHistogram& latency = result.latency;
+            cout << left << setw(10) << strategy << right << setw(12)
+                 << static_cast<uint64_t>(static_cast<double>(latency.Count()) / options.seconds)
+                 << setw(10) << latency.Percentile(0.5) << setw(10) << latency.Percentile(0.99)
+                 << setw(11) << latency.Percentile(0.999) << setw(12) << latency.Max()
+                 << setw(12) << static_cast<double>(result.updates) / options.seconds << setw(13)
+                 << (result.updates == 0 ? 0.0 : result.update_seconds * 1e3 / static_cast<double>(result.updates)) << '\n';
+        }
+        cout << defaultfloat << flush;
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Резидентная память процесса из /proc/self/status (VmRSS и VmHWM), в байтах.
+struct ResidentMemory {
+    size_t current = 0;
+    size_t peak = 0;
+};
+
+ResidentMemory ReadResidentMemory() {
+    ResidentMemory memory;
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        const auto kib = [&line] { return stoull(line.substr(line.find(':') + 1)) * 1024; };
+        if (line.rfind("VmRSS:", 0) == 0) {
+            memory.current = kib();
+        } else if (line.rfind("VmHWM:", 0) == 0) {
+            memory.peak = kib();
+        }
+    }
+    return memory;
+}
+
+// Сбрасывает пик RSS до текущего значения; false, если ядро этого не позволяет.
+bool ResetPeakResidentMemory() {
+    ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5" << flush;
+    return static_cast<bool>(clear_refs);
+}
+
+// Синтетический список формы shape для --bench-memory:
+// flat — имена второго уровня в нескольких зонах, как в типичных блоклистах;
+// deep — поддомены третьего-четвёртого уровня под тысячей сайтов, как у трекеров и CDN.
+vector<Domain> SyntheticList(string_view shape, size_t count) {
+    static constexpr array<string_view, 6> zones = {"com"sv, "ru"sv, "net"sv, "org"sv, "info"sv, "xyz"sv};
+    mt19937 random(42);
+    const auto label = [&random](size_t min_length, size_t max_length) {
+        string result(min_length + random() % (max_length - min_length + 1), 'a');
+        for (char& c : result) {
+            c = static_cast<char>('a' + random() % 26);
+        }
+        return result;
+    };
+    vector<Domain> list;
+    list.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const string_view zone = zones[random() % zones.size()];
+        if (shape == "flat"sv) {
+            list.emplace_back(label(6, 14) + '.' + string(zone));
+        } else {
+            list.emplace_back(label(3, 8) + '.' + label(3, 8) + ".site" + to_string(random() % 1000) + '.' + string(zone));
+        }
+    }
+    return list;
+}
+
+// Режим --bench-memory [LIST]: для синтетических списков flat и deep (и для LIST, если задан)
+// строит каждый вид проверщика и печатает оценку MemoryUsage() на запись с разбивкой
+// по частям, а также прирост RSS: пиковый во время построения и устойчивый после него.
+// До и после построения свободная память кучи возвращается системе (malloc_trim).
+int RunMemoryBench(const optional<string>& list_path) {
+    try {
+        constexpr size_t SYNTHETIC_ENTRIES = 200'000;
+        constexpr double MIB = 1 << 20;
+        vector<pair<string, vector<Domain>>> shapes;
+        shapes.emplace_back("flat", SyntheticList("flat"sv, SYNTHETIC_ENTRIES));
+        shapes.emplace_back("deep", SyntheticList("deep"sv, SYNTHETIC_ENTRIES));
+        if (list_path) {
+            shapes.emplace_back("list", ReadDomainsFile(*list_path));
+        }
+
+        cout << left << setw(7) << "shape" << setw(10) << "backend" << right << setw(10) << "entries"
+             << setw(14) << "bytes/entry" << setw(14) << "RSS/entry" << setw(12) << "peak MiB" << setw(12) << "steady MiB"
+             << '\n' << fixed << setprecision(1);
+        for (const auto& [shape, list] : shapes) {
+            const double entries = static_cast<double>(max<size_t>(list.size(), 1));
+            ForEachBackend(list, [&, &shape = shape](const string& backend, auto build) {
+                malloc_trim(0);
+                const size_t baseline = ReadResidentMemory().current;
+                const bool peak_known = ResetPeakResidentMemory();
+                const auto checker = build();
+                // Пик и текущий RSS читаются в разные моменты, и страницы могли уйти в своп,
+                // поэтому разность с baseline ограничивается снизу нулём, а не вычитается как есть.
+                const size_t peak = ReadResidentMemory().peak;
+                const size_t peak_growth = peak > baseline ? peak - baseline : 0;
+                malloc_trim(0);  // временные буферы построения не входят в устойчивый RSS
+                const size_t current = ReadResidentMemory().current;
+                const size_t steady = current > baseline ? current - baseline : 0;
+                const MemoryBreakdown usage = checker.MemoryUsage();
+
+                cout << left << setw(7) << shape << setw(10) << backend << right << setw(10) << list.size()
+                     << setw(14) << static_cast<double>(usage.Total()) / entries
+                     << setw(14) << static_cast<double>(steady) / entries << setw(12);
+                if (peak_known) {
+                    cout << static_cast<double>(peak_growth) / MIB;
+                } else {
+                    cout << "-";
+                }
+                cout << setw(12) << static_cast<double>(steady) / MIB << '\n';
+                for (const auto& [part, bytes] : usage.parts) {
+                    cout << "    " << left << setw(20) << part << right << setw(10) << static_cast<double>(bytes) / entries
+                         << " bytes/entry\n";
+                }
+            });
+        }
+        cout << defaultfloat << flush;
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Режим --compile LIST OUT: собирает скомпилированный индекс из текстового списка.
+int RunCompile(const string& list_path, const string& out_path) {
+    try {
+        const vector<Domain> domains = ReadDomainsFile(list_path);
+        WriteFileAtomically(out_path, CompiledDomainIndex::Compile(domains.begin(), domains.end()));
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Перезагрузка списка в серверных режимах по SIGHUP или по изменению файла (inotify).
+// Фоновый поток разбирает файл и строит новый DomainChecker, затем подменяет его в
+// ReloadableChecker; потоки запросов всё это время работают со старым индексом.
+// Новый список сначала проверяется (см. ReadCompleteDomainsFile):
+// недописанный или испорченный файл не трогает текущий индекс.
+// Время загрузки и изменение числа правил пишутся в log (по умолчанию stderr).
+// SIGHUP должен быть заблокирован во всех потоках до их создания
+// (см. BlockReloadSignal), иначе сигнал завершит процесс вместо перезагрузки.
+class ReloadWatcher {
+public:
+    ReloadWatcher(string list_path, ReloadableChecker& checker, size_t rules, ostream& log = cerr)
+        : list_path_(move(list_path))
+        , checker_(checker)
+        , rules_(rules)
+        , log_(log) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGHUP);
+        signal_fd_ = signalfd(-1, &signals, SFD_CLOEXEC);
+        stop_fd_ = eventfd(0, EFD_CLOEXEC);
+        inotify_fd_ = inotify_init1(IN_CLOEXEC);
+        // Следим за каталогом: редакторы и деплой обычно заменяют файл через rename.
+        const size_t slash = list_path_.rfind('/');
+        const string directory = slash == string::npos ? "." : list_path_.substr(0, max(slash, size_t{1}));
+        file_name_ = slash == string::npos ? list_path_ : list_path_.substr(slash + 1);
+        inotify_add_watch(inotify_fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        thread_ = thread([this] { Loop(); });
+    }
+
+    ReloadWatcher(const ReloadWatcher&) = delete;
+    ReloadWatcher& operator=(const ReloadWatcher&) = delete;
+
+    ~ReloadWatcher() {
+        const uint64_t one = 1;
+        if (write(stop_fd_, &one, sizeof(one)) == sizeof(one)) {
+            thread_.join();
+        } else {
+            thread_.detach();
+        }
+        close(inotify_fd_);
+        close(stop_fd_);
+        close(signal_fd_);
+    }
+
+    static void BlockReloadSignal() {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+
+    // Перезагружает список сейчас же, как по SIGHUP. Возвращает false, если новый список
+    // отклонён и в checker остался прежний.
+    bool Reload() {
+        lock_guard lock(reload_mutex_);
+        const auto start = chrono::steady_clock::now();
+        TRACE_POINT0(reload__begin);
+        try {
+            const vector<Domain> forbidden = ReadCompleteDomainsFile(list_path_);
+            checker_.Set(make_shared<const DomainChecker>(forbidden.begin(), forbidden.end()));
+            TRACE_POINT1(reload__end, static_cast<int64_t>(forbidden.size()));
+            const chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+            const auto delta = static_cast<long long>(forbidden.size()) - static_cast<long long>(rules_);
+            log_ << "Reloaded " << forbidden.size() << " rules (" << (delta >= 0 ? "+" : "") << delta
+                 << ") from " << list_path_ << " in " << elapsed.count() << " ms" << endl;
+            rules_ = forbidden.size();
+            return true;
+        } catch (const exception& e) {
+            TRACE_POINT1(reload__end, int64_t{-1});
+            log_ << "Reload of " << list_path_ << " failed, keeping previous list: " << e.what() << endl;
+            return false;
+        }
+    }
+
+private:
+    void Loop() {
+        array<pollfd, 3> fds{};
+        fds[0] = {stop_fd_, POLLIN, 0};
+        fds[1] = {signal_fd_, POLLIN, 0};
+        fds[2] = {inotify_fd_, POLLIN, 0};
+        alignas(inotify_event) char buffer[4096];
+        while (poll(fds.data(), fds.size(), -1) >= 0 || errno == EINTR) {
+            if (fds[0].revents & POLLIN) { return; }
+            bool reload = false;
+            if (fds[1].revents & POLLIN) {
+                signalfd_siginfo info;
+                reload = read(signal_fd_, &info, sizeof(info)) == sizeof(info);
+            }
+            if (fds[2].revents & POLLIN) {
+                const ssize_t size = read(inotify_fd_, buffer, sizeof(buffer));
+                for (ssize_t pos = 0; pos < size;) {
+                    const auto* event = reinterpret_cast<const inotify_event*>(buffer + pos);
+                    if (event->len != 0 && file_name_ == event->name) {
+                        reload = true;
+                    }
+                    pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+                }
+            }
+            if (reload) {
+                Reload();
+            }
+        }
+    }
 
-    Number num;
-    std::istringstream(line) >> num;
+    string list_path_;
+    string file_name_;
+    ReloadableChecker& checker_;
+    size_t rules_;
+    ostream& log_;
+    mutex reload_mutex_;
+    int signal_fd_ = -1;
+    int stop_fd_ = -1;
+    int inotify_fd_ = -1;
+    thread thread_;
+};
 
-    return num;
+// Серверный режим (--serve-unix или --serve-http): список из --list с перезагрузкой
+// через ReloadWatcher, запросы обслуживает SocketServer.
+int RunServer(const CheckOptions& options) {
+    try {
+        ReloadWatcher::BlockReloadSignal();
+        const vector<Domain> forbidden = ReadDomainsFile(options.list_path);
+        ReloadableChecker checker(make_shared<const DomainChecker>(forbidden.begin(), forbidden.end()));
+        ReloadWatcher watcher(options.list_path, checker, forbidden.size());
+        const bool http = options.serve_http_port != 0;
+        SocketServer server(http ? ListenLoopback(options.serve_http_port) : ListenUnix(options.serve_unix_path),
+                            http ? http_protocol::ProcessRequests : frame_protocol::ProcessFrames, checker);
+        cerr << "Serving " << forbidden.size() << " rules on "
+             << (http ? "127.0.0.1:" + to_string(options.serve_http_port) : options.serve_unix_path) << endl;
+        server.Run(thread::hardware_concurrency());
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
 }
 
 // Тесты
@@ -227,24 +4475,1170 @@ void RunTests() {
         assert(checker.IsForbidden(Domain("a.b")) == false);
     }
 
+    // Тест 10: OverlayDomainChecker — база общая, у арендатора свои запреты и исключения
+    {
+        vector<Domain> base_list = { Domain("gdz.ru"), Domain("com") };
+        auto base = make_shared<const DomainChecker>(base_list.begin(), base_list.end());
+
+        vector<Domain> added = { Domain("maps.me"), Domain("bad.math.gdz.ru") };
+        vector<Domain> exceptions = { Domain("math.gdz.ru"), Domain("good.com") };
+        OverlayDomainChecker tenant(base, added.begin(), added.end(), exceptions.begin(), exceptions.end());
+
+        assert(tenant.IsForbidden(Domain("history.gdz.ru")) == true);
+        assert(tenant.IsForbidden(Domain("math.gdz.ru")) == false);
+        assert(tenant.IsForbidden(Domain("x.math.gdz.ru")) == false);
+        assert(tenant.IsForbidden(Domain("bad.math.gdz.ru")) == true);
+        assert(tenant.IsForbidden(Domain("m.maps.me")) == true);
+        assert(tenant.IsForbidden(Domain("good.com")) == false);
+        assert(tenant.IsForbidden(Domain("evil.com")) == true);
+        assert(tenant.IsForbidden(Domain("ya.ru")) == false);
+
+        // Другой арендатор с пустой дельтой видит ровно базовый список.
+        vector<Domain> empty;
+        OverlayDomainChecker plain(base, empty.begin(), empty.end(), empty.begin(), empty.end());
+        assert(plain.IsForbidden(Domain("math.gdz.ru")) == true);
+        assert(plain.IsForbidden(Domain("maps.me")) == false);
+
+        // IP-адреса и CIDR-префиксы базы действуют и под дельтой арендатора.
+        vector<Domain> ip_base_list = { Domain("8.8.8.8"), Domain("10.0.0.0/8"), Domain("gdz.ru") };
+        auto ip_base = make_shared<const DomainChecker>(ip_base_list.begin(), ip_base_list.end());
+        vector<Domain> ip_exceptions = { Domain("10.1.0.0/16") };
+        OverlayDomainChecker ip_tenant(ip_base, empty.begin(), empty.end(), ip_exceptions.begin(), ip_exceptions.end());
+        assert(ip_tenant.IsForbidden(Domain("8.8.8.8")) == true);
+        assert(ip_tenant.IsForbidden(Domain("10.2.3.4")) == true);
+        assert(ip_tenant.IsForbidden(Domain("10.1.2.3")) == false);
+        assert(ip_tenant.IsForbidden(Domain("8.8.4.4")) == false);
+        assert(ip_tenant.IsForbidden(Domain("a..gdz.ru")) == false);
+    }
+
+    // Тест 11: PersistentDomainTrie — старые версии не меняются после изменений
+    {
+        PersistentDomainTrie v0;
+        PersistentDomainTrie v1 = v0.Insert(Domain("gdz.ru")).Insert(Domain("maps.me")).Insert(Domain("com"));
+        PersistentDomainTrie v2 = v1.Erase(Domain("gdz.ru")).Insert(Domain("m.gdz.ru"));
+
+        assert(v0.Size() == 0 && v1.Size() == 3 && v2.Size() == 3);
+        assert(v0.IsForbidden(Domain("gdz.ru")) == false);
+        assert(v1.IsForbidden(Domain("math.gdz.ru")) == true);
+        assert(v1.IsForbidden(Domain("freegdz.ru")) == false);
+        assert(v1.IsForbidden(Domain("gdz.com")) == true);
+        assert(v2.IsForbidden(Domain("math.gdz.ru")) == false);
+        assert(v2.IsForbidden(Domain("a.m.gdz.ru")) == true);
+        assert(v2.IsForbidden(Domain("m.maps.me")) == true);
+
+        // Повторная вставка и удаление отсутствующего не меняют размер.
+        assert(v2.Insert(Domain("com")).Size() == 3);
+        assert(v2.Erase(Domain("ya.ru")).Size() == 3);
+    }
+
+    // Тест 12: VersionedDomainChecker — снимки и откат
+    {
+        VersionedDomainChecker checker(3);
+        checker.Add(Domain("gdz.ru"));
+        const PersistentDomainTrie snapshot = checker.Snapshot();
+        checker.Add(Domain("maps.me"));
+        checker.Remove(Domain("gdz.ru"));
+
+        assert(checker.IsForbidden(Domain("math.gdz.ru")) == false);
+        assert(checker.IsForbidden(Domain("maps.me")) == true);
+        assert(snapshot.IsForbidden(Domain("math.gdz.ru")) == true);
+        assert(snapshot.IsForbidden(Domain("maps.me")) == false);
+
+        assert(checker.VersionCount() == 3);
+        assert(checker.Rollback(1));
+        assert(checker.IsForbidden(Domain("math.gdz.ru")) == true);
+        assert(!checker.Rollback(2));
+    }
+
+    // Тест 13: CompiledDomainIndex — сборка и проверка по байтам
+    {
+        vector<Domain> forbidden = { Domain("gdz.ru"), Domain("maps.me"), Domain("gdz-x.ru"), Domain("gdz.ru") };
+        const CompiledDomainIndex index = CompiledDomainIndex::FromBytes(
+            CompiledDomainIndex::Compile(forbidden.begin(), forbidden.end()));
+
+        assert(index.Size() == 3);
+        assert(index.GetReversed(0) == "me.maps");
+        assert(index.GetReversed(1) == "ru.gdz");
+        assert(index.GetReversed(2) == "ru.gdz-x");
+        assert(index.IsForbidden(Domain("math.gdz.ru")) == true);
+        assert(index.IsForbidden(Domain("a.gdz-x.ru")) == true);
+        assert(index.IsForbidden(Domain("freegdz.ru")) == false);
+        assert(index.IsForbidden(Domain("ru")) == false);
+    }
+
+    // Тест 14: журнал — запись, доигрывание и недописанная последняя строка
+    {
+        stringstream log;
+        WriteLogRecord(log, LogRecord{true, "gdz.ru"});
+        WriteLogRecord(log, LogRecord{true, "maps.me"});
+        WriteLogRecord(log, LogRecord{false, "gdz.ru"});
+        log << "+ com";
+
+        VersionedDomainChecker checker(4);
+        assert(ReplayLog(log, checker) == 3);
+        assert(checker.IsForbidden(Domain("m.maps.me")) == true);
+        assert(checker.IsForbidden(Domain("gdz.ru")) == false);
+        assert(checker.IsForbidden(Domain("a.com")) == false);
+    }
+
+    // Тест 15: DiffSortedReversed — дельта применяется поверх старой версии
+    {
+        const vector<string> old_keys = { "com.a", "ru.gdz", "ru.gdz-x", "ru.ya" };
+        const vector<string> new_keys = { "me.maps", "ru.gdz", "ru.gdz.math", "ru.ya" };
+        vector<LogRecord> delta;
+        DiffSortedReversed(old_keys, new_keys, [&delta](const LogRecord& record) {
+            delta.push_back(record);
+        });
+
+        assert(delta.size() == 4);
+        assert(!delta[0].add && delta[0].domain == "a.com");
+        assert(delta[1].add && delta[1].domain == "maps.me");
+        assert(delta[2].add && delta[2].domain == "math.gdz.ru");
+        assert(!delta[3].add && delta[3].domain == "gdz-x.ru");
+
+        VersionedDomainChecker checker(2);
+        PersistentDomainTrie old_version;
+        for (const string& key : old_keys) {
+            old_version = old_version.Insert(Domain::FromReversed(key));
+        }
+        checker.Reset(old_version);
+        checker.Apply(delta);
+
+        vector<string> applied;
+        checker.Snapshot().ForEach([&applied](string_view key) {
+            applied.emplace_back(key);
+        });
+        assert(applied == new_keys);
+        assert(checker.Rollback(1));
+        assert(checker.IsForbidden(Domain("x.a.com")) == true);
+    }
+
+    // Тест 16: CombineSortedReversed — предок покрывает потомков, результат не зависит от числа потоков
+    {
+        const vector<string> vendor = { "com.a", "com.a.x", "com.b.y", "me.maps", "ru.gdz", "ru.gdz-x" };
+        const vector<string> allow = { "com.a.z", "com.b", "ru.gdz", "ru.ya" };
+
+        for ([[maybe_unused]] size_t threads : {1, 3}) {
+            assert((CombineSortedReversed(vendor, allow, SetOperation::UNION, threads)
+                    == vector<string>{ "com.a", "com.b", "me.maps", "ru.gdz", "ru.gdz-x", "ru.ya" }));
+            assert((CombineSortedReversed(vendor, allow, SetOperation::INTERSECTION, threads)
+                    == vector<string>{ "com.a.z", "com.b.y", "ru.gdz" }));
+            assert((CombineSortedReversed(vendor, allow, SetOperation::DIFFERENCE, threads)
+                    == vector<string>{ "com.a", "me.maps", "ru.gdz-x" }));
+        }
+        assert(CombineSortedReversed({}, {}, SetOperation::UNION, 4).empty());
+    }
+
+    // Тест 17: ForEachForbiddenUnder — перечисление поддерева
+    {
+        vector<Domain> forbidden = { Domain("gdz.ru"), Domain("math.gdz.ru"), Domain("a.b.gdz.ru"),
+                                     Domain("gdz-x.ru"), Domain("freegdz.ru"), Domain("ru"), Domain("maps.me") };
+        DomainChecker checker(forbidden.begin(), forbidden.end());
+        const CompiledDomainIndex index = CompiledDomainIndex::FromBytes(
+            CompiledDomainIndex::Compile(forbidden.begin(), forbidden.end()));
+
+        vector<string> from_checker;
+        checker.ForEachForbiddenUnder(Domain("gdz.ru"), [&](string_view key) { from_checker.emplace_back(key); });
+        vector<string> from_index;
+        index.ForEachForbiddenUnder(Domain("gdz.ru"), [&](string_view key) { from_index.emplace_back(key); });
+        assert((from_checker == vector<string>{ "ru.gdz", "ru.gdz.b.a", "ru.gdz.math" }));
+        assert((from_index == vector<string>{ "ru.gdz", "ru.gdz.b.a", "ru.gdz.math" }));
+
+        size_t count = 0;
+        checker.ForEachForbiddenUnder(Domain("b.gdz.ru"), [&](string_view) { ++count; });
+        index.ForEachForbiddenUnder(Domain("ya.ru"), [&](string_view) { ++count; });
+        assert(count == 1);
+    }
+
+    // Тест 18: IP-литералы не обращаются и проверяются по префиксам
+    {
+        assert(Domain("1.2.3.4").GetReversed() == "1.2.3.4");
+        assert(Domain("1.2.3.4").GetIp().has_value());
+        assert(!Domain("1.2.3.com").GetIp().has_value());
+        assert(!Domain("1.2.3.4/33").GetIp().has_value());
+        assert(Domain("2001:db8::1").GetIp()->v6);
+
+        vector<Domain> forbidden = { Domain("gdz.ru"), Domain("10.0.0.0/8"), Domain("192.168.1.128/25"),
+                                     Domain("8.8.8.8"), Domain("2001:db8::/32") };
+        DomainChecker checker(forbidden.begin(), forbidden.end());
+
+        assert(checker.IsForbidden(Domain("10.20.30.40")) == true);
+        assert(checker.IsForbidden(Domain("11.0.0.1")) == false);
+        assert(checker.IsForbidden(Domain("192.168.1.200")) == true);
+        assert(checker.IsForbidden(Domain("192.168.1.100")) == false);
+        assert(checker.IsForbidden(Domain("8.8.8.8")) == true);
+        assert(checker.IsForbidden(Domain("8.8.4.4")) == false);
+        assert(checker.IsForbidden(Domain("2001:db8:1::5")) == true);
+        assert(checker.IsForbidden(Domain("2001:db9::5")) == false);
+        assert(checker.IsForbidden(Domain("::ffff:10.0.0.1")) == false);
+        assert(checker.IsForbidden(Domain("math.gdz.ru")) == true);
+    }
+
+    // Тест 19: TyposquatDetector — похожие метки и смена зоны
+    {
+        vector<Domain> brands = { Domain("sberbank.ru"), Domain("paypal.com"), Domain("ya.ru") };
+        TyposquatDetector detector(brands.begin(), brands.end());
+
+        assert(detector.FindLookalike(Domain("sberbnak.ru")) == "sberbank.ru"sv);
+        assert(detector.FindLookalike(Domain("login.sbrbank.com")) == "sberbank.ru"sv);
+        assert(detector.FindLookalike(Domain("paypa1.com")) == "paypal.com"sv);
+        assert(detector.FindLookalike(Domain("paypal.net")) == "paypal.com"sv);
+        assert(detector.FindLookalike(Domain("paypal.com")) == nullopt);
+        assert(detector.FindLookalike(Domain("www.paypal.com")) == nullopt);
+        assert(detector.FindLookalike(Domain("pypl.com")) == nullopt);
+        assert(detector.FindLookalike(Domain("yb.ru")) == nullopt);
+        assert(detector.FindLookalike(Domain("ya.com")) == "ya.ru"sv);
+        assert(detector.FindLookalike(Domain("com")) == nullopt);
+        assert(detector.FindLookalike(Domain(string(30, 's') + ".ru")) == nullopt);
+
+        // Метки предельной длины: удаления на краях и в середине строки.
+        const string long_brand = string(31, 'a') + string(32, 'b');
+        vector<Domain> long_brands = { Domain(long_brand + ".com") };
+        TyposquatDetector long_detector(long_brands.begin(), long_brands.end());
+        assert(long_detector.FindLookalike(Domain(string(30, 'a') + string(32, 'b') + "c.net")) == long_brand + ".com");
+        assert(long_detector.FindLookalike(Domain(string(34, 'a') + string(29, 'b') + ".net")) == nullopt);
+    }
+
+    // Тест 20: DgaScorer — словарные метки проходят, случайные помечаются
+    {
+        const DgaScorer scorer;
+        for ([[maybe_unused]] const char* name : { "google.com", "stackoverflow.com", "odnoklassniki.ru", "weatherforecast.net",
+                                  "kinopoisk.ru", "www.wikipedia.org", "ya.ru" }) {
+            assert(!scorer.IsSuspicious(Domain(name)));
+        }
+        for ([[maybe_unused]] const char* name : { "xkcdqzpl.com", "qwxzkjhgfdrt.com", "a8f3k2l9x0z.net", "kjsdhfuweyr.ru", "3f2a9c8b7d6e1f0a.info" }) {
+            assert(scorer.IsSuspicious(Domain(name)));
+        }
+    }
+
+    // Тест 21: FindRule возвращает номер правила из исходного списка
+    {
+        vector<Domain> forbidden = { Domain("gdz.ru"), Domain("10.0.0.0/8"), Domain("math.gdz.ru"), Domain("gdz.ru"),
+                                     Domain("172.16.4.0/22"), Domain("172.16.0.0/20") };
+        DomainChecker checker(forbidden.begin(), forbidden.end());
+
+        assert(checker.FindRule(Domain("a.math.gdz.ru")) == 0u);
+        assert(checker.FindRule(Domain("10.1.2.3")) == 1u);
+        assert(checker.FindRule(Domain("172.16.5.1")) == 4u);
+        assert(checker.FindRule(Domain("172.16.1.1")) == 5u);
+        assert(checker.FindRule(Domain("172.16.9.1")) == 5u);
+        assert(checker.FindRule(Domain("172.16.16.1")) == nullopt);
+        assert(checker.FindRule(Domain("ya.ru")) == nullopt);
+    }
+
+    // Тест 22: MatchRing — переполнение и разбор по порядку
+    {
+        MatchRing ring(3);
+        for (uint32_t i = 0; i < 5; ++i) {
+            ring.TryPush(MatchRecord{i, i, 0});
+        }
+        assert(ring.Dropped() == 1);
+        vector<uint64_t> handles;
+        assert(ring.Drain([&](const MatchRecord& record) { handles.push_back(record.domain_handle); }) == 4);
+        assert((handles == vector<uint64_t>{ 0, 1, 2, 3 }));
+    }
+
+    // Тест 23: ResultWriter — исходная запись домена и экранирование
+    {
+        stringstream output;
+        {
+            ResultWriter plain(output, OutputFormat::PLAIN);
+            plain.Write(Domain("math.gdz.ru"), Verdict::BAD, "gdz.ru"sv, "domain"sv);
+            plain.Write(Domain("ya.ru"), Verdict::GOOD, {}, {});
+        }
+        assert(output.str() == "Bad\nGood\n");
+
+        output.str({});
+        {
+            ResultWriter jsonl(output, OutputFormat::JSONL);
+            jsonl.Write(Domain("math.gdz.ru"), Verdict::BAD, "gdz.ru"sv, "domain"sv);
+            jsonl.Write(Domain("a\"b.ru"), Verdict::GOOD, {}, {});
+            jsonl.Write(Domain("10.0.0.1"), Verdict::BAD, "10.0.0.0/8"sv, "ip"sv);
+        }
+        assert(output.str() ==
+            "{\"domain\":\"math.gdz.ru\",\"verdict\":\"Bad\",\"rule\":\"gdz.ru\",\"category\":\"domain\"}\n"
+            "{\"domain\":\"a\\\"b.ru\",\"verdict\":\"Good\",\"rule\":null,\"category\":null}\n"
+            "{\"domain\":\"10.0.0.1\",\"verdict\":\"Bad\",\"rule\":\"10.0.0.0/8\",\"category\":\"ip\"}\n");
+
+        output.str({});
+        {
+            ResultWriter tsv(output, OutputFormat::TSV);
+            tsv.Write(Domain("paypa1.com"), Verdict::SUSPICIOUS, "paypal.com"sv, "typosquat"sv);
+            tsv.Write(Domain("com"), Verdict::BAD, "com"sv, "domain"sv);
+        }
+        assert(output.str() == "paypa1.com\tSuspicious\tpaypal.com\ttyposquat\ncom\tBad\tcom\tdomain\n");
+    }
+
+    // Тест 24: frame_protocol — конвейер кадров и незаконченный кадр
+    {
+        vector<Domain> forbidden = { Domain("gdz.ru") };
+        DomainChecker checker(forbidden.begin(), forbidden.end());
+
+        string input;
+        const string first = "math.gdz.ru\nya.ru\r\ngdz.ru";
+        frame_protocol::AppendHeader(input, first.size());
+        input += first;
+        frame_protocol::AppendHeader(input, 6);
+        input += "gdz";
+
+        string output;
+        assert(frame_protocol::ProcessFrames(input, output, checker));
+        assert(output == string("\x03\0\0\0BGB", 7));
+        assert(input == string("\x06\0\0\0gdz", 7));
+
+        input += ".ru";
+        assert(frame_protocol::ProcessFrames(input, output, checker));
+        assert(input.empty());
+        assert(output.substr(7) == string("\x01\0\0\0B", 5));
+
+        string oversized;
+        frame_protocol::AppendHeader(oversized, frame_protocol::MAX_PAYLOAD + 1);
+        assert(!frame_protocol::ProcessFrames(oversized, output, checker));
+    }
+
+    // Тест 25: http_protocol — одиночный и пакетный запросы, keep-alive и Connection: close
+    {
+        vector<Domain> forbidden = { Domain("gdz.ru") };
+        DomainChecker checker(forbidden.begin(), forbidden.end());
+
+        string input = "GET /check?domain=math.gdz.ru HTTP/1.1\r\nHost: x\r\n\r\n"
+                       "POST /check HTTP/1.1\r\ncontent-length: 14\r\n\r\nya.ru\ngdz.ru\n\n"
+                       "GET /other HTTP/1.1\r\n\r\nGET /check?dom";
+        string output;
+        assert(http_protocol::ProcessRequests(input, output, checker));
+        assert(input == "GET /check?dom");
+        const string single = "{\"domain\":\"math.gdz.ru\",\"verdict\":\"Bad\"}";
+        const string batch = "{\"results\":[{\"domain\":\"ya.ru\",\"verdict\":\"Good\"},"
+                             "{\"domain\":\"gdz.ru\",\"verdict\":\"Bad\"}]}";
+        const string not_found = "{\"error\":\"not found\"}";
+        assert(output == "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "
+                         + to_string(single.size()) + "\r\n\r\n" + single
+                         + "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "
+                         + to_string(batch.size()) + "\r\n\r\n" + batch
+                         + "HTTP/1.1 404 Not Found\r\nContent-Type: application/json\r\nContent-Length: "
+                         + to_string(not_found.size()) + "\r\n\r\n" + not_found);
+
+        input = "GET /check?x=1&domain=a%2Egdz.ru HTTP/1.1\r\nConnection: close\r\n\r\n";
+        output.clear();
+        assert(!http_protocol::ProcessRequests(input, output, checker));
+        assert(output.find("Connection: close") != string::npos);
+        assert(output.find("\"domain\":\"a.gdz.ru\",\"verdict\":\"Bad\"") != string::npos);
+
+        input = "GET /check?subdomain=gdz.ru&domain=ya.ru HTTP/1.1\r\n\r\n"
+                "GET /check?xdomain=gdz.ru HTTP/1.1\r\n\r\n"
+                "POST /check HTTP/1.1\r\nContent-Length: 4\r\n\r\na\x01\"b";
+        output.clear();
+        assert(http_protocol::ProcessRequests(input, output, checker));
+        assert(output.find("{\"domain\":\"ya.ru\",\"verdict\":\"Good\"}") != string::npos);
+        assert(output.find("400 Bad Request") != string::npos);
+        assert(output.find("{\"domain\":\"a\\u0001\\\"b\",\"verdict\":\"Invalid\"}") != string::npos);
+
+        assert(ParsePort("8080"sv) == 8080);
+        assert(!ParsePort("0"sv) && !ParsePort("65536"sv) && !ParsePort("-1"sv) && !ParsePort("80x"sv));
+    }
+
+    // Тест 26: ReverseInto и проверка скомпилированного индекса без Domain
+    {
+        string scratch;
+        ReverseInto("math.gdz.ru"sv, scratch);
+        assert(scratch == "ru.gdz.math");
+        ReverseInto("com"sv, scratch);
+        assert(scratch == "com");
+        ReverseInto("a..b."sv, scratch);
+        assert(scratch == ".b..a");
+        ReverseInto(""sv, scratch);
+        assert(scratch.empty());
+
+        vector<Domain> forbidden = { Domain("gdz.ru") };
+        const CompiledDomainIndex index = CompiledDomainIndex::FromBytes(
+            CompiledDomainIndex::Compile(forbidden.begin(), forbidden.end()));
+        ReverseInto("math.gdz.ru"sv, scratch);
+        assert(index.IsForbiddenReversed(scratch));
+        ReverseInto("freegdz.ru"sv, scratch);
+        assert(!index.IsForbiddenReversed(scratch));
+    }
+
+    // Тест 27: контрольные суммы скомпилированного индекса
+    {
+        assert(Crc32c("123456789"sv) == 0xE3069283u);
+        assert(Crc32c("6789"sv, Crc32c("12345"sv)) == 0xE3069283u);
+
+        vector<Domain> forbidden = { Domain("gdz.ru"), Domain("maps.me") };
+        const string bytes = CompiledDomainIndex::Compile(forbidden.begin(), forbidden.end());
+        assert(CompiledDomainIndex::FromBytes(bytes).IsForbidden(Domain("math.gdz.ru")));
+
+        [[maybe_unused]] const auto rejects = [](string damaged, IndexVerification verification) {
+            try {
+                CompiledDomainIndex::FromBytes(move(damaged), verification);
+            } catch (const runtime_error&) {
+                return true;
+            }
+            return false;
+        };
+        // Порча ключа: полная проверка ловит её при открытии,
+        // ленивая — при первом поиске, задевшем блок.
+        string damaged = bytes;
+        damaged[damaged.rfind("gdz")] = 'x';
+        assert(rejects(damaged, IndexVerification::FULL));
+        assert(!rejects(damaged, IndexVerification::LAZY));
+        const CompiledDomainIndex lazy = CompiledDomainIndex::FromBytes(damaged, IndexVerification::LAZY);
+        [[maybe_unused]] bool caught = false;
+        try {
+            lazy.IsForbidden(Domain("gdz.ru"));
+        } catch (const runtime_error&) {
+            caught = true;
+        }
+        assert(caught);
+
+        // Порча заголовка и обрезанный файл отвергаются в любом режиме проверки.
+        damaged = bytes;
+        damaged[16] ^= 1;
+        assert(rejects(damaged, IndexVerification::LAZY));
+        assert(rejects(bytes.substr(0, bytes.size() - 3), IndexVerification::LAZY));
+        assert(rejects("DCIDX001"s + string(16, '\0'), IndexVerification::FULL));
+    }
+
+    // Тест 28: проверка имён хостов при разборе Domain
+    {
+        assert(Domain("math.gdz.ru").IsValid());
+        assert(Domain("_dmarc.Mail-1.example.com").IsValid());
+        assert(Domain("ya.ru.").IsValid() && Domain("ya.ru.").GetReversed() == "ru.ya");
+        assert(Domain("10.0.0.0/8").IsValid() && Domain("::1").IsValid());
+        assert(Domain("a..b").GetError() == HostnameError::EMPTY_LABEL);
+        assert(Domain(".ru").GetError() == HostnameError::EMPTY_LABEL);
+        assert(Domain("").GetError() == HostnameError::EMPTY_LABEL);
+        assert(Domain("gdz.ru/path").GetError() == HostnameError::BAD_CHARACTER);
+        assert(Domain("a b.ru").GetError() == HostnameError::BAD_CHARACTER);
+        assert(Domain(string(63, 'a') + ".ru").IsValid());
+        assert(Domain(string(64, 'a') + ".ru").GetError() == HostnameError::LABEL_TOO_LONG);
+        const string label(63, 'a');
+        const string longest = label + '.' + label + '.' + label + '.' + string(61, 'a');
+        assert(longest.size() == 253 && Domain(longest).IsValid());
+        assert(Domain(longest + "a").GetError() == HostnameError::TOO_LONG);
+        // Некорректная запись всё равно обращается, как и раньше.
+        assert(Domain("a..b.").GetReversed() == "b..a");
+        assert(Domain("math.gdz.ru").ToString() == "math.gdz.ru");
+        assert(Domain(".ru").ToString() == ".ru" && Domain::FromReversed("ru.").ToString() == ".ru");
+        assert(Domain("a..b").ToString() == "a..b");
+
+        vector<Domain> forbidden = { Domain("gdz.ru") };
+        DomainChecker checker(forbidden.begin(), forbidden.end());
+        string input;
+        const string payload = "math.gdz.ru\na..gdz.ru\nya.ru";
+        frame_protocol::AppendHeader(input, payload.size());
+        input += payload;
+        string output;
+        assert(frame_protocol::ProcessFrames(input, output, checker));
+        assert(output == string("\x03\0\0\0BIG", 7));
+    }
+
+    // Тест 29: проверка доменов, пакеты, потоки кадров и HTTP-запросов и вывод не выделяют память после прогрева
+    {
+        vector<Domain> forbidden = { Domain("gdz.ru"), Domain("10.0.0.0/8"), Domain("maps.me") };
+        DomainChecker checker(forbidden.begin(), forbidden.end());
+        const CompiledDomainIndex index = CompiledDomainIndex::FromBytes(
+            CompiledDomainIndex::Compile(forbidden.begin(), forbidden.end()));
+        const vector<Domain> queries = { Domain("math.gdz.ru"), Domain("a.rather.long.subdomain.example.com"),
+                                         Domain("10.1.2.3"), Domain("2001:db8::1"), Domain("ya.ru") };
+
+        const array<string_view, 3> names = { "math.gdz.ru"sv, "a.rather.long.subdomain.example.com"sv, "ya.ru"sv };
+        array<const char*, names.size()> pointers{};
+        array<size_t, names.size()> lengths{};
+        for (size_t i = 0; i < names.size(); ++i) {
+            pointers[i] = names[i].data();
+            lengths[i] = names[i].size();
+        }
+        array<uint8_t, names.size()> verdicts{};
+
+        string frame;
+        const string payload = "math.gdz.ru\na.rather.long.subdomain.example.com\n2001:db8::1";
+        frame_protocol::AppendHeader(frame, payload.size());
+        frame += payload;
+        const string http_request = "POST /check HTTP/1.1\r\nContent-Length: 48\r\n\r\n"
+                                    "math.gdz.ru\na.rather.long.subdomain.example.com\n"
+                                    "GET /check?domain=maps.me HTTP/1.1\r\n\r\n";
+        string input;
+        string output;
+        string http_output;
+
+        ostringstream sink;
+        {
+            ResultWriter writer(sink, OutputFormat::JSONL);
+            MatchRing ring(16);
+            size_t hits = 0;
+            const auto hot_path = [&] {
+                hits = 0;
+                for (const Domain& domain : queries) {
+                    hits += checker.IsForbidden(domain) + index.IsForbidden(domain);
+                    if (const optional<uint32_t> rule = checker.FindRule(domain)) {
+                        ring.TryPush(MatchRecord{hits, *rule, 0});
+                        writer.Write(domain, Verdict::BAD, "gdz.ru"sv, "domain"sv);
+                    } else {
+                        writer.Write(domain, Verdict::GOOD, {}, {});
+                    }
+                }
+                hits += static_cast<size_t>(CheckBatch(index, pointers.data(), lengths.data(), names.size(), verdicts.data()));
+                input = frame;
+                output.clear();
+                frame_protocol::ProcessFrames(input, output, checker);
+                input = http_request;
+                http_output.clear();
+                http_protocol::ProcessRequests(input, http_output, checker);
+            };
+            hot_path();  // прогрев: буферы потока, ёмкость строк
+            [[maybe_unused]] const uint64_t allocations = CountAllocations(hot_path);
+            assert(allocations == 0);
+            assert(hits == 4 && output == string("\x03\0\0\0BGG", 7));
+            assert(http_output.find("\"a.rather.long.subdomain.example.com\",\"verdict\":\"Good\"}]}") != string::npos && input.empty());
+            assert(http_output.find("\"maps.me\",\"verdict\":\"Bad\"}") != string::npos);
+        }
+    }
+
+    // Тест 30: MemoryUsage — разбивка по частям растёт вместе со списком
+    {
+        vector<Domain> forbidden = { Domain("gdz.ru"), Domain("a.rather.long.subdomain.example.com") };
+        const CompiledDomainIndex index = CompiledDomainIndex::FromBytes(
+            CompiledDomainIndex::Compile(forbidden.begin(), forbidden.end()));
+        const MemoryBreakdown compiled = index.MemoryUsage();
+        assert(compiled.Total() == 3 * sizeof(uint64_t) + "ru.gdz"s.size() + "com.example.subdomain.long.rather.a"s.size());
+
+        const DomainChecker one(forbidden.begin(), forbidden.begin() + 1);
+        const DomainChecker two(forbidden.begin(), forbidden.end());
+        assert(one.MemoryUsage().Total() > 0 && two.MemoryUsage().Total() > one.MemoryUsage().Total());
+
+        PersistentDomainTrie trie;
+        [[maybe_unused]] const size_t empty = trie.MemoryUsage().Total();
+        trie = trie.Insert(forbidden[0]);
+        assert(empty == 0 && trie.MemoryUsage().Total() > 0);
+    }
+
+    // Тест 31: статистика для --bench-compare — среднее, отклонение и 95% интервал
+    {
+        [[maybe_unused]] const SampleStats stats = Summarize({ 10, 12, 14 });
+        assert(stats.count == 3 && stats.mean == 12 && stats.stddev == 2);
+        assert(fabs(ConfidenceHalfWidth(stats) - 4.303 * 2 / sqrt(3.0)) < 1e-9);
+        assert(ConfidenceHalfWidth(Summarize({ 5 })) == 0);
+        assert(StudentT975(2.7) == 4.303 && StudentT975(1000) == 1.960);
+    }
+
+    // Тест 32: LatencyHistogram — перцентили с погрешностью не больше 1/16
+    {
+        LatencyHistogram histogram;
+        for (uint64_t nanos = 1; nanos <= 10000; ++nanos) {
+            histogram.Record(nanos);
+        }
+        assert(histogram.Count() == 10000 && histogram.Max() == 10000);
+        for (const double q : { 0.5, 0.99, 0.999 }) {
+            [[maybe_unused]] const double exact = q * 10000;
+            [[maybe_unused]] const double reported = static_cast<double>(histogram.Percentile(q));
+            assert(reported >= exact && reported <= exact * (1 + 1.0 / 16));
+        }
+        LatencyHistogram other;
+        other.Record(7);
+        histogram.Merge(other);
+        assert(histogram.Count() == 10001 && histogram.Percentile(0) == 1);
+    }
+
+    // Тест 33: PhaseTimer — выключенный молчит, включённый печатает фазы и переносит время
+    {
+        ostringstream silent;
+        PhaseTimer off(false);
+        off.Finish("check"sv, 10, "domains"sv);
+        off.Report(silent, PhaseTimer::Format::JSON);
+        assert(silent.str().empty());
+
+        ostringstream json;
+        PhaseTimer on(true);
+        on.Finish("check"sv, 10, "domains"sv);
+        on.Finish("output"sv, 40, "bytes"sv);
+        on.Transfer("check"sv, "output"sv, 1.0);
+        on.Report(json, PhaseTimer::Format::JSON);
+        const string report = json.str();
+        assert(report.find("{\"name\":\"check\",\"seconds\":0,") != string::npos);
+        assert(report.find("\"seconds\":-") == string::npos);
+        assert(report.find("\"items\":40,\"unit\":\"bytes\"") != string::npos);
+    }
+
     cerr << "All tests passed!" << endl;
 }
 
+// Создаёт временный каталог для тестов с файлами и сокетами.
+string MakeTestDirectory() {
+    char dir_template[] = "/tmp/domain_checker_test.XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        throw runtime_error("cannot create test directory: "s + strerror(errno));
+    }
+    return dir_template;
+}
+
+// Тесты с побочными эффектами: временные файлы, сокеты и фоновые потоки.
+// Запускаются только по --self-test, чтобы обычный старт не трогал файловую систему.
+void RunSelfTests() {
+    // Тест 34: DurableDomainIndex — снимок и журнал на диске, перезапуск, Checkpoint и недописанный хвост
+    {
+        const string dir = MakeTestDirectory();
+        const string snapshot_path = dir + "/index.snapshot";
+        const string log_path = dir + "/index.log";
+        [[maybe_unused]] const auto read_log = [&log_path] {
+            ifstream input(log_path, ios::binary);
+            ostringstream bytes;
+            bytes << input.rdbuf();
+            return bytes.str();
+        };
+        {
+            ofstream snapshot(snapshot_path, ios::binary);
+            snapshot << CompiledDomainIndex::Build({ "me.maps", "ru.gdz" });
+            ofstream log(log_path, ios::binary);
+            WriteLogRecord(log, LogRecord{true, "ya.ru"});
+            WriteLogRecord(log, LogRecord{false, "gdz.ru"});
+            log << "+ com";
+        }
+        {
+            DurableDomainIndex index(snapshot_path, log_path);
+            assert(index.ReplayedRecords() == 2);
+            assert(index.IsForbidden(Domain("a.ya.ru")) == true);
+            assert(index.IsForbidden(Domain("gdz.ru")) == false);
+            assert(index.IsForbidden(Domain("m.maps.me")) == true);
+            assert(index.IsForbidden(Domain("a.com")) == false);
+            assert(read_log() == "+ ya.ru\n- gdz.ru\n");
+
+            index.Add(Domain("gdz.ru"));
+            index.Remove(Domain("maps.me"));
+            index.Add(Domain("example.org"));
+        }
+        assert(read_log() == "+ ya.ru\n- gdz.ru\n+ gdz.ru\n- maps.me\n+ example.org\n");
+        {
+            DurableDomainIndex index(snapshot_path, log_path);
+            assert(index.ReplayedRecords() == 5);
+            vector<string> keys;
+            index.Snapshot().ForEach([&keys](string_view reversed) {
+                keys.emplace_back(reversed);
+            });
+            assert((keys == vector<string>{ "org.example", "ru.gdz", "ru.ya" }));
+            assert(index.Snapshot().Size() == 3);
+
+            index.Checkpoint();
+            assert(index.Snapshot().DeltaSize() == 0);
+            assert(index.IsForbidden(Domain("math.gdz.ru")) == true);
+            assert(read_log().empty());
+        }
+        {
+            DurableDomainIndex index(snapshot_path, log_path);
+            assert(index.ReplayedRecords() == 0);
+            assert(index.Snapshot().Size() == 3);
+            assert(index.IsForbidden(Domain("www.example.org")) == true);
+            assert(index.IsForbidden(Domain("maps.me")) == false);
+        }
+        unlink(snapshot_path.c_str());
+        unlink(log_path.c_str());
+        rmdir(dir.c_str());
+    }
+
+    // Тест 35: SocketServer отвечает на кадры, пришедшие вместе с концом передачи
+    {
+        const string dir = MakeTestDirectory();
+        const string socket_path = dir + "/server.sock";
+        vector<Domain> forbidden = { Domain("gdz.ru") };
+        const ReloadableChecker checker(make_shared<const DomainChecker>(forbidden.begin(), forbidden.end()));
+        SocketServer server(ListenUnix(socket_path), frame_protocol::ProcessFrames, checker);
+        thread serving([&server] { server.Run(1); });
+
+        const int client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+        [[maybe_unused]] const int connected = connect(client, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+        assert(connected == 0);
+        string request;
+        for (const string_view payload : { "math.gdz.ru\nya.ru"sv, "a..b"sv }) {
+            frame_protocol::AppendHeader(request, payload.size());
+            request += payload;
+        }
+        [[maybe_unused]] const ssize_t written = write(client, request.data(), request.size());
+        assert(written == static_cast<ssize_t>(request.size()));
+        shutdown(client, SHUT_WR);
+        string response;
+        char buffer[256];
+        for (ssize_t received; (received = read(client, buffer, sizeof(buffer))) > 0;) {
+            response.append(buffer, static_cast<size_t>(received));
+        }
+        close(client);
+        server.Stop();
+        serving.join();
+        unlink(socket_path.c_str());
+        rmdir(dir.c_str());
+
+        string expected;
+        frame_protocol::AppendHeader(expected, 2);
+        expected += "BG";
+        frame_protocol::AppendHeader(expected, 1);
+        expected += 'I';
+        assert(response == expected);
+    }
+
+    // Тест 36: C API — открытие, пакет, перезагрузка, статистика и ошибки
+    {
+        const string dir = MakeTestDirectory();
+        const string first_path = dir + "/first.idx";
+        const string second_path = dir + "/second.idx";
+        const vector<Domain> first = { Domain("gdz.ru"), Domain("8.8.8.8") };
+        const vector<Domain> second = { Domain("maps.me") };
+        WriteFileAtomically(first_path, CompiledDomainIndex::Compile(first.begin(), first.end()));
+        WriteFileAtomically(second_path, CompiledDomainIndex::Compile(second.begin(), second.end()));
+
+        assert(checker_api_version() == CHECKER_API_VERSION);
+        assert(checker_open_compiled((dir + "/missing.idx").c_str()) == nullptr);
+        assert(*checker_last_error() != '\0');
+
+        checker_t* checker = checker_open_compiled(first_path.c_str());
+        assert(checker != nullptr);
+        const vector<string_view> names = { "math.gdz.ru"sv, "gdz.ru."sv, "a..b"sv, "8.8.8.8"sv, "8.8"sv, "ya.ru"sv };
+        vector<const char*> pointers;
+        vector<size_t> lengths;
+        for (const string_view name : names) {
+            pointers.push_back(name.data());
+            lengths.push_back(name.size());
+        }
+        vector<uint8_t> verdicts(names.size());
+        assert(checker_check_batch(checker, pointers.data(), lengths.data(), names.size(), verdicts.data()) == 3);
+        assert((verdicts == vector<uint8_t>{ CHECKER_VERDICT_BAD, CHECKER_VERDICT_BAD, CHECKER_VERDICT_INVALID,
+                                             CHECKER_VERDICT_BAD, CHECKER_VERDICT_GOOD, CHECKER_VERDICT_GOOD }));
+        assert(checker_check_batch(checker, nullptr, nullptr, 1, nullptr) == -1);
+
+        assert(checker_reload(checker, (dir + "/missing.idx").c_str()) == -1);
+        assert(checker_check_batch(checker, pointers.data(), lengths.data(), 1, verdicts.data()) == 1);
+        assert(checker_reload(checker, second_path.c_str()) == 0);
+        const string_view maps = "m.maps.me"sv;
+        [[maybe_unused]] const char* maps_pointer = maps.data();
+        [[maybe_unused]] const size_t maps_length = maps.size();
+        assert(checker_check_batch(checker, &maps_pointer, &maps_length, 1, verdicts.data()) == 1);
+        assert(checker_check_batch(checker, pointers.data(), lengths.data(), 1, verdicts.data()) == 0);
+
+        checker_stats_t stats{};
+        checker_get_stats(checker, &stats);
+        assert(stats.rules == 1 && stats.queries == 9 && stats.matches == 5 && stats.reloads == 1);
+        checker_close(checker);
+        unlink(first_path.c_str());
+        unlink(second_path.c_str());
+        rmdir(dir.c_str());
+    }
+
+    // Тест 37: ReloadWatcher — полный список подменяется, недописанный или испорченный отклоняется
+    {
+        const string dir = MakeTestDirectory();
+        const string list_path = dir + "/list.txt";
+        const auto write_list = [&list_path](string_view content) {
+            ofstream output(list_path);
+            output << content;
+        };
+        write_list("2\ngdz.ru\nmaps.me\n");
+        const vector<Domain> initial = ReadCompleteDomainsFile(list_path);
+        ReloadableChecker checker(make_shared<const DomainChecker>(initial.begin(), initial.end()));
+        ostringstream log;
+        {
+            ReloadWatcher watcher(list_path, checker, initial.size(), log);
+            const shared_ptr<const DomainChecker> before = checker.Get();
+            for (const string_view broken : { "3\ngdz.ru\nmaps.me\n"sv, "two\ngdz.ru\nmaps.me\n"sv,
+                                              "1\ngdz.ru\nmaps.me\n"sv }) {
+                write_list(broken);
+                assert(!watcher.Reload());
+                assert(checker.Get() == before);
+            }
+            write_list("3\ngdz.ru\nmaps.me\nya.ru\n");
+            assert(watcher.Reload());
+            assert(checker.Get()->IsForbidden(Domain("a.ya.ru")) == true);
+            assert(checker.Get()->IsForbidden(Domain("gdz.ru")) == true);
+
+            // Сокращение списка — обычная перезагрузка, даже до пустого.
+            write_list("1\nya.ru\n");
+            assert(watcher.Reload());
+            assert(checker.Get()->IsForbidden(Domain("gdz.ru")) == false);
+            write_list("0\n");
+            assert(watcher.Reload());
+            assert(checker.Get()->IsForbidden(Domain("ya.ru")) == false);
+        }
+        assert(log.str().find("declares 3 domains but has 2") != string::npos);
+        assert(log.str().find("bad domain count") != string::npos);
+        assert(log.str().find("more than the declared 1") != string::npos);
+        assert(log.str().find("Reloaded 3 rules (+1)") != string::npos);
+        assert(log.str().find("Reloaded 1 rules (-2)") != string::npos);
+        assert(log.str().find("Reloaded 0 rules (-1)") != string::npos);
+        unlink(list_path.c_str());
+        rmdir(dir.c_str());
+    }
+
+    // Тест 38: AsyncMatchLogger — запись из нескольких потоков и чередование журналов
+    {
+        stringstream output;
+        {
+            AsyncMatchLogger logger(output);
+            vector<thread> threads;
+            for (uint32_t t = 0; t < 3; ++t) {
+                threads.emplace_back([&logger, t] {
+                    for (uint64_t i = 0; i < 1000; ++i) {
+                        logger.Log(i, t);
+                    }
+                });
+            }
+            for (thread& th : threads) {
+                th.join();
+            }
+            assert(logger.Dropped() == 0);
+        }
+        size_t lines = 0;
+        for (string line; getline(output, line); ++lines) {
+            assert(count(line.begin(), line.end(), '\t') == 2);
+        }
+        assert(lines == 3000);
+
+        // Поток, чередующий журналы, держит по одному буферу в каждом и не выделяет память.
+        stringstream first_output, second_output;
+        {
+            AsyncMatchLogger first(first_output);
+            AsyncMatchLogger second(second_output);
+            first.Log(0, 0);
+            second.Log(0, 0);
+            [[maybe_unused]] const uint64_t allocations = CountAllocations([&] {
+                for (uint64_t i = 1; i <= 200; ++i) {
+                    (i % 2 == 0 ? first : second).Log(i, 0);
+                }
+            });
+            assert(allocations == 0);
+            assert(first.RingCount() == 1 && second.RingCount() == 1);
+        }
+        const string first_lines = first_output.str();
+        assert(count(first_lines.begin(), first_lines.end(), '\n') == 101);
+    }
+
+    cerr << "All self-tests passed!" << endl;
+}
+
+} // namespace
+#endif // DOMAIN_CHECKER_LIBRARY
+
+// Реализация C API из domain_checker.h.
+// Текущий индекс хранится в shared_ptr и заменяется атомарно; пакет проверок
+// берёт одну ссылку на индекс в начале, поэтому перезагрузка не мешает идущим проверкам.
+// Для каждой (пере)загрузки отмечается время до готовности индекса и время
+// до завершения первого пакета проверок после неё — разница показывает,
+// сколько первые запросы теряют на подгрузке страниц.
+struct checker {
+    shared_ptr<const CompiledDomainIndex> index;
+    unsigned flags = 0;
+    atomic<uint64_t> queries{0};
+    atomic<uint64_t> matches{0};
+    atomic<uint64_t> reloads{0};
+    atomic<int64_t> load_start_ns{0};
+    atomic<int64_t> ready_ns{0};
+    atomic<int64_t> first_query_ns{0};
+};
+
+namespace {
+
+thread_local string c_api_last_error;
+
+int64_t SteadyNowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+shared_ptr<const CompiledDomainIndex> OpenCompiledShared(const char* path, unsigned flags) {
+    try {
+        c_api_last_error.clear();
+        MapOptions options;
+        options.prefault = (flags & CHECKER_OPEN_PREFAULT) != 0;
+        options.lock = (flags & CHECKER_OPEN_MLOCK) != 0;
+        const IndexVerification verification =
+            (flags & CHECKER_OPEN_LAZY_VERIFY) != 0 ? IndexVerification::LAZY : IndexVerification::FULL;
+        return make_shared<const CompiledDomainIndex>(CompiledDomainIndex::Open(path, options, verification));
+    } catch (const exception& e) {
+        c_api_last_error = e.what();
+        return nullptr;
+    }
+}
+
+// Подменяет индекс и начинает отсчёт времени до первого запроса к нему.
+void InstallIndex(checker_t& checker, shared_ptr<const CompiledDomainIndex> index, int64_t start_ns) {
+    checker.first_query_ns.store(0, memory_order_relaxed);
+    checker.load_start_ns.store(start_ns, memory_order_relaxed);
+    checker.ready_ns.store(SteadyNowNs() - start_ns, memory_order_relaxed);
+    atomic_store(&checker.index, move(index));
+}
+
 } // namespace
 
-int main() {
+extern "C" {
+
+int checker_api_version(void) {
+    return CHECKER_API_VERSION;
+}
+
+checker_t* checker_open_compiled(const char* path) {
+    return checker_open_compiled_ex(path, 0);
+}
+
+checker_t* checker_open_compiled_ex(const char* path, unsigned flags) {
+    if (path == nullptr) { return nullptr; }
+    const int64_t start_ns = SteadyNowNs();
+    auto index = OpenCompiledShared(path, flags);
+    if (!index) { return nullptr; }
+    auto* result = new (nothrow) checker_t;
+    if (result != nullptr) {
+        result->flags = flags;
+        InstallIndex(*result, move(index), start_ns);
+    }
+    return result;
+}
+
+void checker_close(checker_t* checker) {
+    delete checker;
+}
+
+int64_t checker_check_batch(checker_t* checker, const char* const* domains, const size_t* lengths,
+                            size_t count, uint8_t* verdicts) {
+    if (checker == nullptr || (count != 0 && (domains == nullptr || lengths == nullptr || verdicts == nullptr))) {
+        return -1;
+    }
+    const shared_ptr<const CompiledDomainIndex> index = atomic_load(&checker->index);
+    int64_t matches = 0;
+    try {
+        matches = CheckBatch(*index, domains, lengths, count, verdicts);
+    } catch (const exception& e) {
+        c_api_last_error = e.what();
+        return -1;
+    }
+    checker->queries.fetch_add(count, memory_order_relaxed);
+    checker->matches.fetch_add(static_cast<uint64_t>(matches), memory_order_relaxed);
+    if (checker->first_query_ns.load(memory_order_relaxed) == 0) {
+        int64_t expected = 0;
+        const int64_t elapsed = SteadyNowNs() - checker->load_start_ns.load(memory_order_relaxed);
+        checker->first_query_ns.compare_exchange_strong(expected, max<int64_t>(elapsed, 1), memory_order_relaxed);
+    }
+    return matches;
+}
+
+int checker_reload(checker_t* checker, const char* path) {
+    if (checker == nullptr || path == nullptr) { return -1; }
+    const int64_t start_ns = SteadyNowNs();
+    TRACE_POINT0(reload__begin);
+    auto index = OpenCompiledShared(path, checker->flags);
+    TRACE_POINT1(reload__end, index ? static_cast<int64_t>(index->Size()) : int64_t{-1});
+    if (!index) { return -1; }
+    InstallIndex(*checker, move(index), start_ns);
+    checker->reloads.fetch_add(1, memory_order_relaxed);
+    return 0;
+}
+
+void checker_get_stats(const checker_t* checker, checker_stats_t* stats) {
+    if (checker == nullptr || stats == nullptr) { return; }
+    stats->rules = atomic_load(&checker->index)->Size();
+    stats->queries = checker->queries.load(memory_order_relaxed);
+    stats->matches = checker->matches.load(memory_order_relaxed);
+    stats->reloads = checker->reloads.load(memory_order_relaxed);
+}
+
+void checker_get_load_timing(const checker_t* checker, checker_load_timing_t* timing) {
+    if (checker == nullptr || timing == nullptr) { return; }
+    timing->time_to_ready_ns = static_cast<uint64_t>(checker->ready_ns.load(memory_order_relaxed));
+    timing->time_to_first_query_ns = static_cast<uint64_t>(checker->first_query_ns.load(memory_order_relaxed));
+    timing->locked = atomic_load(&checker->index)->IsLocked() ? 1 : 0;
+}
+
+const char* checker_last_error(void) {
+    return c_api_last_error.c_str();
+}
+
+} // extern "C"
+
+#ifndef DOMAIN_CHECKER_LIBRARY
+int main(int argc, char* argv[]) {
     RunTests();
 
+    const vector<string_view> args(argv + 1, argv + argc);
+    if (args.size() == 1 && args[0] == "--self-test"sv) {
+        try {
+            RunSelfTests();
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (args.size() == 3 && args[0] == "--diff"sv) {
+        return RunDiff(string(args[1]), string(args[2]), cout);
+    }
+    if (args.size() == 2 && args[0] == "--http-load"sv) {
+        const optional<uint16_t> port = ParsePort(args[1]);
+        if (!port) {
+            cerr << "bad port for --http-load: " << args[1] << " (expected 1-65535)" << endl;
+            return 1;
+        }
+        return RunHttpLoad(*port, thread::hardware_concurrency(), 3.0);
+    }
+    if (args.size() >= 3 && args[0] == "--bench"sv) {
+        size_t repetitions = 5;
+        string json_path;
+        for (size_t i = 3; i < args.size(); ++i) {
+            if (args[i] == "--repetitions"sv && i + 1 < args.size()) {
+                const optional<size_t> count = ParseNumber<size_t>(args[++i]);
+                if (!count || *count == 0) {
+                    cerr << "--repetitions expects a positive integer, got " << args[i] << endl;
+                    return 1;
+                }
+                repetitions = *count;
+            } else if (args[i] == "--json"sv && i + 1 < args.size()) {
+                json_path = string(args[++i]);
+            } else {
+                cerr << "unknown option: " << args[i] << endl;
+                return 1;
+            }
+        }
+        return RunBench(string(args[1]), string(args[2]), repetitions, json_path);
+    }
+    if (args.size() >= 3 && args[0] == "--bench-churn"sv) {
+        ChurnOptions churn;
+        for (size_t i = 3; i < args.size(); ++i) {
+            if (args[i] == "--readers"sv && i + 1 < args.size()) {
+                const optional<size_t> readers = ParseNumber<size_t>(args[++i]);
+                if (!readers || *readers == 0) {
+                    cerr << "--readers expects a positive integer, got " << args[i] << endl;
+                    return 1;
+                }
+                churn.readers = *readers;
+            } else if (args[i] == "--rate"sv && i + 1 < args.size()) {
+                const optional<double> rate = ParseNumber<double>(args[++i]);
+                if (!rate || !isfinite(*rate) || *rate < 0) {
+                    cerr << "--rate expects a non-negative number, got " << args[i] << endl;
+                    return 1;
+                }
+                churn.updates_per_second = *rate;
+            } else if (args[i] == "--delta"sv && i + 1 < args.size()) {
+                const optional<size_t> delta = ParseNumber<size_t>(args[++i]);
+                if (!delta) {
+                    cerr << "--delta expects a non-negative integer, got " << args[i] << endl;
+                    return 1;
+                }
+                churn.delta_size = *delta;
+            } else if (args[i] == "--seconds"sv && i + 1 < args.size()) {
+                const optional<double> seconds = ParseNumber<double>(args[++i]);
+                if (!seconds || !isfinite(*seconds) || *seconds <= 0) {
+                    cerr << "--seconds expects a positive number, got " << args[i] << endl;
+                    return 1;
+                }
+                churn.seconds = *seconds;
+            } else {
+                cerr << "unknown option: " << args[i] << endl;
+                return 1;
+            }
+        }
+        return RunChurnBench(string(args[1]), string(args[2]), churn);
+    }
+    if ((args.size() == 3 || (args.size() == 5 && args[3] == "--threshold"sv)) && args[0] == "--bench-compare"sv) {
+        const optional<double> threshold = args.size() == 5 ? ParseNumber<double>(args[4]) : 2.0;
+        if (!threshold || !isfinite(*threshold) || *threshold < 0) {
+            cerr << "--threshold expects a non-negative percentage, got " << args[4] << endl;
+            return 1;
+        }
+        return RunBenchCompare(string(args[1]), string(args[2]), *threshold);
+    }
+    if (!args.empty() && args.size() <= 2 && args[0] == "--bench-memory"sv) {
+        return RunMemoryBench(args.size() == 2 ? optional<string>(args[1]) : nullopt);
+    }
+    if (args.size() == 3 && args[0] == "--compile"sv) {
+        return RunCompile(string(args[1]), string(args[2]));
+    }
+    if (args.size() == 5 && args[0] == "--set"sv) {
+        return RunSetOperation(args[1], string(args[2]), string(args[3]), string(args[4]));
+    }
+
+    const optional<CheckOptions> options = ParseCheckOptions(args);
+    if (!options) {
+        return 1;
+    }
+
+    if (!options->serve_unix_path.empty() || options->serve_http_port != 0) {
+        return RunServer(*options);
+    }
+
     // 1. Читает число N и N запрещённых доменов.
     // 2. Создаёт DomainChecker с этими доменами.
     // 3. Читает число M и M проверяемых доменов.
     // 4. Для каждого выводит "Bad", если запрещён (или его супердомен), иначе "Good".
-    
+    //    Строка, не являющаяся именем хоста (пустые метки, недопустимые символы,
+    //    превышение длины), выводится как "Invalid".
+    //    С --brands разрешённый домен, похожий на бренд, выводится как "Suspicious",
+    //    с --dga — так же выводится разрешённый домен с высокой оценкой DgaScorer.
+    // С --timing (--timing-json) в stderr печатается длительность каждой фазы.
+
+    PhaseTimer timer(options->timing.has_value());
+    optional<TyposquatDetector> typosquats;
+    if (!options->brands_path.empty()) {
+        const vector<Domain> brands = ReadDomainsFile(options->brands_path);
+        typosquats.emplace(brands.begin(), brands.end());
+    }
+
+    ofstream match_log;
+    optional<AsyncMatchLogger> match_logger;
+    if (!options->match_log_path.empty()) {
+        match_log.open(options->match_log_path, ios::app);
+        if (!match_log.is_open()) {
+            cerr << "cannot open " << options->match_log_path << endl;
+            return 1;
+        }
+        match_logger.emplace(match_log);
+    }
+
+    optional<DgaScorer> dga;
+    if (options->dga) {
+        dga.emplace();
+    }
+    timer.Finish("setup"sv, 0, {});
+
     const std::vector<Domain> forbidden_domains = ReadDomains(cin, ReadNumberOnLine<size_t>(cin));
+    timer.Finish("read_list"sv, forbidden_domains.size(), "domains"sv);
     DomainChecker checker(forbidden_domains.begin(), forbidden_domains.end());
 
+    // Тексты правил готовятся один раз, чтобы форматирование в цикле не выделяло память.
+    vector<string> rule_names;
+    if (options->format != OutputFormat::PLAIN) {
+        rule_names.reserve(forbidden_domains.size());
+        for (const Domain& domain : forbidden_domains) {
+            rule_names.push_back(domain.ToString());
+        }
+    }
+    timer.Finish("build"sv, forbidden_domains.size(), "rules"sv);
+
     const std::vector<Domain> test_domains = ReadDomains(cin, ReadNumberOnLine<size_t>(cin));
-    for (const Domain& domain : test_domains) {
-        cout << (checker.IsForbidden(domain) ? "Bad"sv : "Good"sv) << endl;
+    timer.Finish("read_queries"sv, test_domains.size(), "domains"sv);
+    ResultWriter writer(cout, options->format);
+    size_t matches = 0;
+    TRACE_POINT1(batch__begin, test_domains.size());
+    for (size_t i = 0; i < test_domains.size(); ++i) {
+        const Domain& domain = test_domains[i];
+        if (!domain.IsValid()) {
+            writer.Write(domain, Verdict::INVALID, {}, HostnameErrorName(domain.GetError()));
+        } else if (const optional<uint32_t> rule = checker.FindRule(domain)) {
+            if (match_logger) {
+                match_logger->Log(i, *rule);
+            }
+            ++matches;
+            const string_view rule_name = rule_names.empty() ? string_view{} : string_view(rule_names[*rule]);
+            writer.Write(domain, Verdict::BAD, rule_name, domain.GetIp() ? "ip"sv : "domain"sv);
+        } else if (const auto brand = typosquats ? typosquats->FindLookalike(domain) : nullopt) {
+            writer.Write(domain, Verdict::SUSPICIOUS, *brand, "typosquat"sv);
+        } else if (dga && dga->IsSuspicious(domain)) {
+            writer.Write(domain, Verdict::SUSPICIOUS, {}, "dga"sv);
+        } else {
+            writer.Write(domain, Verdict::GOOD, {}, {});
+        }
+    }
+    TRACE_POINT2(batch__end, test_domains.size(), matches);
+    timer.Finish("check"sv, test_domains.size(), "domains"sv);
+    const double written_in_loop = writer.WriteSeconds();
+    writer.Flush();
+    timer.Finish("output"sv, writer.BytesWritten(), "bytes"sv);
+    timer.Transfer("check"sv, "output"sv, written_in_loop);
+    if (options->timing) {
+        timer.Report(cerr, *options->timing);
     }
 }
+#endif // DOMAIN_CHECKER_LIBRARY